@@ -24,7 +24,17 @@
 #include "tools.h"
 #include <algorithm>
 #include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
 #include <set>
+#include <fstream>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#if !defined(WIN32)
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
 
 using namespace Database;
 
@@ -34,12 +44,108 @@ using namespace Database;
 CardSet Database::cards;
 Game Database::game;
 
+// Card database snapshot
+// ======================
+
+namespace Database
+{
+    /// Header of the card database snapshot. Sections follow the header
+    /// in the order below. Strings are referred by their offset in the
+    /// string table and all strings end with a zero byte.
+    struct SnapshotHeader
+    {
+	/// File format identifier.
+	char magic[8];
+	/// Number of card records.
+	unsigned int cards;
+	/// Number of attribute pairs.
+	unsigned int pairs;
+	/// Number of entries in the name index.
+	unsigned int names;
+	/// Number of card sets.
+	unsigned int sets;
+	/// Number of rarities.
+	unsigned int rarities;
+	/// Number of attribute names.
+	unsigned int attributes;
+	/// Number of source files.
+	unsigned int sources;
+	/// Size of the string table.
+	unsigned int strings;
+    };
+
+    /// Card record of the snapshot.
+    struct SnapshotCard
+    {
+	/// Name of the card.
+	unsigned int name;
+	/// Set abbreviation of the card.
+	unsigned int set;
+	/// First attribute pair of the card element.
+	unsigned int first_property;
+	/// Number of attributes of the card element.
+	unsigned int properties;
+	/// First attribute pair of 'attr' subelements.
+	unsigned int first_attr;
+	/// Number of 'attr' subelements.
+	unsigned int attrs;
+    };
+
+    /// Attribute name and value.
+    struct SnapshotPair
+    {
+	unsigned int key;
+	unsigned int value;
+    };
+
+    /// Entry of the name index.
+    struct SnapshotName
+    {
+	unsigned int name;
+	int card;
+    };
+
+    /// Card set of the snapshot.
+    struct SnapshotSet
+    {
+	unsigned int abbrev;
+	unsigned int name;
+	unsigned int dir;
+	int age;
+	int first;
+	int last;
+    };
+
+    /// Card set file the snapshot was made from.
+    struct SnapshotSource
+    {
+	unsigned int file;
+	unsigned int size;
+	unsigned int mtime;
+    };
+}
+
+static const char snapshot_magic[8]={'G','C','C','G','C','D','B','1'};
+
 // Class CardSet
 // =============
 
 CardSet::CardSet()
 {
     nextcard=0;
+    snapshot=0;
+    snapshot_size=0;
+    snapshot_card=0;
+    snapshot_pair=0;
+    snapshot_name=0;
+    snapshot_names=0;
+    snapshot_string=0;
+    snapshot_strings=0;
+}
+
+CardSet::~CardSet()
+{
+    CloseSnapshot();
 }
 
 void CardSet::Validate(XML::Document& D)
@@ -77,6 +183,11 @@ void CardSet::Validate(XML::Document& D)
 void CardSet::AddCards(const string& filename)
 {
     int old_nextcard=nextcard;
+
+    if(snapshot)
+	throw Error::Invalid("CardSet::AddCards(const string&)","cards are already mapped from a snapshot");
+
+    source.push_back(Localization::File(filename));
 	
     if(db.Base()==0)
     {
@@ -131,7 +242,7 @@ string CardSet::ImageFile(int cardnumber) const
     if(cardnumber < 0 || cardnumber >= nextcard)
 	throw Error::Range("CardSet::ImageFile(int)","invalid cardnumber "+ToString(cardnumber));
 
-    return (*card[cardnumber])["graphics"];
+    return Property(cardnumber,"graphics");
 }
 	
 string CardSet::Name(int cardnumber) const
@@ -139,6 +250,9 @@ string CardSet::Name(int cardnumber) const
     if(cardnumber < 0 || cardnumber >= nextcard)
 	throw Error::Range("CardSet::Name(int)","invalid cardnumber "+ToString(cardnumber));
 
+    if(snapshot)
+	return SnapshotString(snapshot_card[cardnumber].name);
+
     return (*card[cardnumber])["name"];
 }
 
@@ -321,8 +435,9 @@ int CardSet::Back(int cardnumber) const
 {
     if(cardnumber < 0 || cardnumber >= nextcard)
 	throw Error::Range("CardSet::Back(int)","invalid cardnumber "+ToString(cardnumber));
-    if((*card[cardnumber])["back"]!="")
-	return atoi((*card[cardnumber])["back"].c_str());
+    string back=Property(cardnumber,"back");
+    if(back!="")
+	return atoi(back.c_str());
 
     return 0;
 }
@@ -331,8 +446,9 @@ int CardSet::Front(int cardnumber) const
 {
     if(cardnumber < 0 || cardnumber >= nextcard)
 	throw Error::Range("CardSet::Front(int)","invalid cardnumber "+ToString(cardnumber));
-    if((*card[cardnumber])["front"]!="")
-	return atoi((*card[cardnumber])["front"].c_str());
+    string front=Property(cardnumber,"front");
+    if(front!="")
+	return atoi(front.c_str());
 
     return 0;
 }
@@ -342,7 +458,7 @@ bool CardSet::IsCard(int cardnumber) const
     if(cardnumber < 0 || cardnumber >= nextcard)
 	throw Error::Range("CardSet::IsCard(int)","invalid cardnumber "+ToString(cardnumber));
 
-    return Set(cardnumber)!="" && atoi((*card[cardnumber])["hidden"].c_str())==0;
+    return Set(cardnumber)!="" && atoi(Property(cardnumber,"hidden").c_str())==0;
 }
 
 bool CardSet::IsSet(const string& s) const
@@ -355,6 +471,9 @@ string CardSet::Set(int cardnumber) const
     if(cardnumber < 0 || cardnumber >= nextcard)
 	throw Error::Range("CardSet::Set(int)","invalid cardnumber "+ToString(cardnumber));
 
+    if(snapshot)
+	return SnapshotString(snapshot_card[cardnumber].set);
+
     return (*card[cardnumber])["set"];
 }
 
@@ -371,7 +490,7 @@ string CardSet::Text(int cardnumber) const
     if(cardnumber < 0 || cardnumber >= nextcard)
 	throw Error::Range("CardSet::Text(int)","invalid cardnumber "+ToString(cardnumber));
 
-    return (*card[cardnumber])["text"];
+    return Property(cardnumber,"text");
 }
 
 list<string> CardSet::Attributes(int cardnumber) const
@@ -380,6 +499,16 @@ list<string> CardSet::Attributes(int cardnumber) const
 	throw Error::Range("CardSet::Attributes(int)","invalid cardnumber "+ToString(cardnumber));
 			
     list<string> ret;
+
+    if(snapshot)
+    {
+	const SnapshotCard& C=snapshot_card[cardnumber];
+	for(unsigned int i=C.first_attr; i<C.first_attr+C.attrs; i++)
+	    ret.push_back(SnapshotString(snapshot_pair[i].key));
+
+	return ret;
+    }
+
     list<XML::Element*>& attr=card[cardnumber]->Subs();
     list<XML::Element*>::const_iterator i;
     for(i=attr.begin(); i!=attr.end(); i++)
@@ -393,6 +522,16 @@ string CardSet::AttrValue(int cardnumber,const string& a) const
     if(cardnumber < 0 || cardnumber >= nextcard)
 	throw Error::Range("CardSet::AttrValue(int,const string)","invalid cardnumber "+ToString(cardnumber));
 
+    if(snapshot)
+    {
+	const SnapshotCard& C=snapshot_card[cardnumber];
+	for(unsigned int i=C.first_attr; i<C.first_attr+C.attrs; i++)
+	    if(a==snapshot_string+snapshot_pair[i].key)
+		return SnapshotString(snapshot_pair[i].value);
+
+	return "";
+    }
+
     if(card[cardnumber]->HasSubAttr("attr","key",a))
 	return (*card[cardnumber]->NthSubWithAttr(0,"attr","key",a))["value"];
     else
@@ -424,9 +563,8 @@ list<int> CardSet::Images(const string& s,bool fuzzymatch)
 	
     if(fuzzymatch)
     {
-	if(numbers[s].size())
-	    ret=numbers[s];
-	else
+	ret=Numbers(s);
+	if(ret.size()==0)
 	{
 	    for(int i=0; i<Cards(); i++)
 		if(FuzzyMatch(Name(i),s))
@@ -447,7 +585,7 @@ list<int> CardSet::Images(const string& s,bool fuzzymatch)
 	}
     }
     else
-	ret=numbers[s];
+	ret=Numbers(s);
 
     // Try to strip set and attribute specifiers.
     if(ret.size()==0)
@@ -525,6 +663,374 @@ list<int> CardSet::Images(const string& s,bool fuzzymatch)
     return ret;
 }
 
+// Snapshot files
+// ==============
+
+/// String table used when writing a snapshot. Each string is stored once.
+class SnapshotStrings
+{
+    map<string,unsigned int> offset;
+
+  public:
+
+    string table;
+
+    /// Return offset of the string, adding it if needed.
+    unsigned int operator()(const string& s)
+    {
+	map<string,unsigned int>::iterator i=offset.find(s);
+	if(i!=offset.end())
+	    return i->second;
+
+	unsigned int ret=table.length();
+	offset[s]=ret;
+	table+=s;
+	table+='\0';
+
+	return ret;
+    }
+};
+
+/// Write a section of a snapshot.
+template <class T> static void WriteSection(ostream& F,const vector<T>& v)
+{
+    if(v.size())
+	F.write((const char*)&v[0],v.size()*sizeof(T));
+}
+
+void CardSet::SaveSnapshot(const string& filename) const
+{
+    if(snapshot)
+	throw Error::Invalid("CardSet::SaveSnapshot(const string&)","cards are already mapped from a snapshot");
+
+    SnapshotStrings S;
+    SnapshotHeader header;
+    vector<SnapshotCard> rec(nextcard);
+    vector<SnapshotPair> pair;
+    vector<SnapshotName> name;
+    vector<SnapshotSet> set_rec;
+    vector<unsigned int> rarity,attribute;
+    vector<SnapshotSource> src;
+
+    for(int i=0; i<nextcard; i++)
+    {
+	XML::Element& E=*card[i];
+	list<string> keys=E.AttributeNames();
+
+	rec[i].name=S(E["name"]);
+	rec[i].set=S(E["set"]);
+	rec[i].first_property=pair.size();
+	rec[i].properties=keys.size();
+	for(list<string>::iterator k=keys.begin(); k!=keys.end(); k++)
+	{
+	    SnapshotPair p;
+	    p.key=S(*k);
+	    p.value=S(E[*k]);
+	    pair.push_back(p);
+	}
+
+	list<XML::Element*>& attr=E.Subs();
+	rec[i].first_attr=pair.size();
+	rec[i].attrs=attr.size();
+	for(list<XML::Element*>::iterator a=attr.begin(); a!=attr.end(); a++)
+	{
+	    SnapshotPair p;
+	    p.key=S((**a)["key"]);
+	    p.value=S((**a)["value"]);
+	    pair.push_back(p);
+	}
+    }
+
+    // Map iterates names in the same byte order as strcmp().
+    map<string,list<int> >::const_iterator n;
+    for(n=numbers.begin(); n!=numbers.end(); n++)
+	for(list<int>::const_iterator j=n->second.begin(); j!=n->second.end(); j++)
+	{
+	    SnapshotName e;
+	    e.name=S(n->first);
+	    e.card=*j;
+	    name.push_back(e);
+	}
+
+    for(list<string>::const_iterator i=sets.begin(); i!=sets.end(); i++)
+    {
+	SnapshotSet s;
+	s.abbrev=S(*i);
+	s.name=S(set_name.find(*i)->second);
+	s.dir=S(directory.find(*i)->second);
+	s.age=age.find(*i)->second;
+	s.first=first_card.find(*i)->second;
+	s.last=last_card.find(*i)->second;
+	set_rec.push_back(s);
+    }
+
+    for(set<string>::const_iterator i=rarities.begin(); i!=rarities.end(); i++)
+	rarity.push_back(S(*i));
+    for(set<string>::const_iterator i=attributes.begin(); i!=attributes.end(); i++)
+	attribute.push_back(S(*i));
+
+    for(list<string>::const_iterator i=source.begin(); i!=source.end(); i++)
+    {
+	struct stat st;
+	if(stat(i->c_str(),&st)!=0)
+	    throw Error::IO("CardSet::SaveSnapshot(const string&)","unable to access "+*i);
+
+	SnapshotSource s;
+	s.file=S(*i);
+	s.size=st.st_size;
+	s.mtime=st.st_mtime;
+	src.push_back(s);
+    }
+
+    memcpy(header.magic,snapshot_magic,sizeof(snapshot_magic));
+    header.cards=rec.size();
+    header.pairs=pair.size();
+    header.names=name.size();
+    header.sets=set_rec.size();
+    header.rarities=rarity.size();
+    header.attributes=attribute.size();
+    header.sources=src.size();
+    header.strings=S.table.length();
+
+    // Replace the snapshot with rename(), since other processes may have it mapped.
+    string tmpfile=filename+".tmp";
+    ofstream F(tmpfile.c_str(),ios::out | ios::binary);
+    if(!F)
+	throw Error::IO("CardSet::SaveSnapshot(const string&)","unable to write "+tmpfile);
+    F.write((const char*)&header,sizeof(header));
+    WriteSection(F,rec);
+    WriteSection(F,pair);
+    WriteSection(F,name);
+    WriteSection(F,set_rec);
+    WriteSection(F,rarity);
+    WriteSection(F,attribute);
+    WriteSection(F,src);
+    F.write(S.table.data(),S.table.length());
+    F.close();
+    if(!F)
+	throw Error::IO("CardSet::SaveSnapshot(const string&)","unable to write "+tmpfile);
+
+#ifdef WIN32
+    unlink(filename.c_str());
+#endif
+    if(rename(tmpfile.c_str(),filename.c_str())!=0)
+	throw Error::IO("CardSet::SaveSnapshot(const string&)","unable to rename "+tmpfile);
+}
+
+bool CardSet::LoadSnapshot(const string& filename,const list<string>& files)
+{
+    if(snapshot || nextcard)
+	throw Error::Invalid("CardSet::LoadSnapshot(const string&,const list<string>&)","cards already loaded");
+
+    struct stat st;
+    if(stat(filename.c_str(),&st)!=0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+	return false;
+
+    snapshot_size=st.st_size;
+#if !defined(WIN32)
+    int fd=open(filename.c_str(),O_RDONLY);
+    if(fd < 0)
+	return false;
+    void* map=mmap(0,snapshot_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if(map==MAP_FAILED)
+	return false;
+    snapshot=(char*)map;
+#else
+    ifstream F(filename.c_str(),ios::in | ios::binary);
+    if(!F)
+	return false;
+    snapshot=new char[snapshot_size];
+    F.read(snapshot,snapshot_size);
+    if(!F)
+    {
+	CloseSnapshot();
+	return false;
+    }
+#endif
+
+    // Check that the sections fill the file exactly.
+    const SnapshotHeader* header=(const SnapshotHeader*)snapshot;
+    size_t size=sizeof(SnapshotHeader)
+	+ (size_t)header->cards*sizeof(SnapshotCard)
+	+ (size_t)header->pairs*sizeof(SnapshotPair)
+	+ (size_t)header->names*sizeof(SnapshotName)
+	+ (size_t)header->sets*sizeof(SnapshotSet)
+	+ (size_t)header->rarities*sizeof(unsigned int)
+	+ (size_t)header->attributes*sizeof(unsigned int)
+	+ (size_t)header->sources*sizeof(SnapshotSource)
+	+ header->strings;
+
+    if(memcmp(header->magic,snapshot_magic,sizeof(snapshot_magic))
+      || size!=snapshot_size
+      || header->strings==0
+      || header->sources!=files.size())
+    {
+	CloseSnapshot();
+	return false;
+    }
+
+    const char* p=snapshot+sizeof(SnapshotHeader);
+    snapshot_card=(const SnapshotCard*)p;
+    p+=header->cards*sizeof(SnapshotCard);
+    snapshot_pair=(const SnapshotPair*)p;
+    p+=header->pairs*sizeof(SnapshotPair);
+    snapshot_name=(const SnapshotName*)p;
+    snapshot_names=header->names;
+    p+=header->names*sizeof(SnapshotName);
+    const SnapshotSet* set_rec=(const SnapshotSet*)p;
+    p+=header->sets*sizeof(SnapshotSet);
+    const unsigned int* rarity=(const unsigned int*)p;
+    p+=header->rarities*sizeof(unsigned int);
+    const unsigned int* attribute=(const unsigned int*)p;
+    p+=header->attributes*sizeof(unsigned int);
+    const SnapshotSource* src=(const SnapshotSource*)p;
+    p+=header->sources*sizeof(SnapshotSource);
+    snapshot_string=p;
+    snapshot_strings=header->strings;
+
+    try
+    {
+	if(snapshot_string[snapshot_strings-1]!='\0')
+	    throw Error::Range("CardSet::LoadSnapshot(const string&,const list<string>&)","unterminated string table");
+
+	// Snapshot is valid only if made from the same unchanged files.
+	list<string>::const_iterator f=files.begin();
+	for(unsigned int i=0; i<header->sources; i++,f++)
+	{
+	    string file=Localization::File(*f);
+	    if(SnapshotString(src[i].file)!=file
+	      || stat(file.c_str(),&st)!=0
+	      || src[i].size!=(unsigned int)st.st_size
+	      || src[i].mtime!=(unsigned int)st.st_mtime)
+	    {
+		CloseSnapshot();
+		return false;
+	    }
+	    source.push_back(file);
+	}
+
+	// Lookups use the records and string offsets without checking them again.
+	for(unsigned int i=0; i<header->cards; i++)
+	{
+	    const SnapshotCard& c=snapshot_card[i];
+	    if(c.first_property > header->pairs || c.properties > header->pairs-c.first_property
+	      || c.first_attr > header->pairs || c.attrs > header->pairs-c.first_attr
+	      || c.name >= snapshot_strings || c.set >= snapshot_strings)
+		throw Error::Range("CardSet::LoadSnapshot(const string&,const list<string>&)","invalid card record");
+	}
+
+	for(unsigned int i=0; i<header->pairs; i++)
+	    if(snapshot_pair[i].key >= snapshot_strings || snapshot_pair[i].value >= snapshot_strings)
+		throw Error::Range("CardSet::LoadSnapshot(const string&,const list<string>&)","invalid attribute pair");
+
+	for(unsigned int i=0; i<header->names; i++)
+	    if(snapshot_name[i].card < 0 || snapshot_name[i].card >= (int)header->cards
+	      || snapshot_name[i].name >= snapshot_strings)
+		throw Error::Range("CardSet::LoadSnapshot(const string&,const list<string>&)","invalid name index");
+
+	// Set tables are small, so they are kept in ordinary containers.
+	for(unsigned int i=0; i<header->sets; i++)
+	{
+	    string abbrev=SnapshotString(set_rec[i].abbrev);
+	    sets.push_back(abbrev);
+	    set_name[abbrev]=SnapshotString(set_rec[i].name);
+	    directory[abbrev]=SnapshotString(set_rec[i].dir);
+	    age[abbrev]=set_rec[i].age;
+	    first_card[abbrev]=set_rec[i].first;
+	    last_card[abbrev]=set_rec[i].last;
+	}
+	for(unsigned int i=0; i<header->rarities; i++)
+	    rarities.insert(SnapshotString(rarity[i]));
+	for(unsigned int i=0; i<header->attributes; i++)
+	    attributes.insert(SnapshotString(attribute[i]));
+    }
+    catch(Error::Range e)
+    {
+	CloseSnapshot();
+	return false;
+    }
+
+    nextcard=header->cards;
+
+    return true;
+}
+
+void CardSet::CloseSnapshot()
+{
+    if(!snapshot)
+	return;
+
+#if !defined(WIN32)
+    munmap(snapshot,snapshot_size);
+#else
+    delete[] snapshot;
+#endif
+    snapshot=0;
+    snapshot_size=0;
+    snapshot_card=0;
+    snapshot_pair=0;
+    snapshot_name=0;
+    snapshot_names=0;
+    snapshot_string=0;
+    snapshot_strings=0;
+
+    sets.clear();
+    set_name.clear();
+    directory.clear();
+    age.clear();
+    first_card.clear();
+    last_card.clear();
+    rarities.clear();
+    attributes.clear();
+    source.clear();
+    nextcard=0;
+}
+
+string CardSet::SnapshotString(unsigned int offset) const
+{
+    if(offset >= snapshot_strings)
+	throw Error::Range("CardSet::SnapshotString(unsigned int)","invalid string offset "+ToString(int(offset)));
+
+    return snapshot_string+offset;
+}
+
+list<int> CardSet::Numbers(const string& s)
+{
+    if(!snapshot)
+	return numbers[s];
+
+    // Find the first entry not less than s.
+    size_t lo=0,hi=snapshot_names;
+    while(lo < hi)
+    {
+	size_t mid=(lo+hi)/2;
+	if(strcmp(snapshot_string+snapshot_name[mid].name,s.c_str()) < 0)
+	    lo=mid+1;
+	else
+	    hi=mid;
+    }
+
+    list<int> ret;
+    while(lo < snapshot_names && s==snapshot_string+snapshot_name[lo].name)
+	ret.push_back(snapshot_name[lo++].card);
+
+    return ret;
+}
+
+string CardSet::Property(int cardnumber,const string& key) const
+{
+    if(!snapshot)
+	return (*card[cardnumber])[key];
+
+    const SnapshotCard& C=snapshot_card[cardnumber];
+    for(unsigned int i=C.first_property; i<C.first_property+C.properties; i++)
+	if(key==snapshot_string+snapshot_pair[i].key)
+	    return SnapshotString(snapshot_pair[i].value);
+
+    return "";
+}
+
 // Class Game
 // ==========
 
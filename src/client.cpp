@@ -675,8 +675,9 @@ int gccg_main(int argc,const char** argv)
 	security.AllowWriteFile(getenv("HOME")+string("/.gccg/")+Database::game.Gamedir()+"/*");
 	security.AllowConnect("*",ANY_PORT);
 
-	// Load card sets.
+	// Load card sets or map them from the snapshot.
 
+	list<string> card_files;
 	for(int i=0; i<Database::game.CardSets(); i++)
 	{
 	    opt=CCG_DATADIR;
@@ -699,10 +700,28 @@ int gccg_main(int argc,const char** argv)
                 cout << Localization::Message("Cannot load %s (maybe need to download extra repository).",Localization::File(opt)) << endl;
                 continue;
             }
-	    cout << Localization::Message("Loading %s",Localization::File(opt)) << endl;
-	    Database::cards.AddCards(opt);
-	    if(Evaluator::quitsignal)
-		throw Error::Quit(1);
+	    card_files.push_back(opt);
+	}
+
+	string snapshot=Evaluator::savedir+"/cards.snapshot";
+	if(card_files.size() && !Database::cards.LoadSnapshot(snapshot,card_files))
+	{
+	    for(list<string>::iterator i=card_files.begin(); i!=card_files.end(); i++)
+	    {
+		cout << Localization::Message("Loading %s",Localization::File(*i)) << endl;
+		Database::cards.AddCards(*i);
+		if(Evaluator::quitsignal)
+		    throw Error::Quit(1);
+	    }
+
+	    try
+	    {
+		Database::cards.SaveSnapshot(snapshot);
+	    }
+	    catch(Error::IO e)
+	    {
+		cerr << e.Message() << endl;
+	    }
 	}
 
 	CCG::Table C(CCG_DATADIR"/scripts/client.triggers",full,debug,fulldebug,nographics,scrw,scrh);
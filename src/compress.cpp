@@ -0,0 +1,193 @@
+/*
+    Gccg - Generic collectible card game.
+    Copyright (C) 2001,2002,2003,2004 Tommi Ronkainen
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program, in the file license.txt. If not, write
+  to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+  Boston, MA 02111-1307, USA.
+*/
+//
+// Compressed data begins with the length of the original data as
+// 4 byte big endian number. It is followed by sequences, each having
+// a token byte, literal bytes copied as such and a match copied from
+// the output produced so far. High 4 bits of the token are the number
+// of literals and low 4 bits the match length minus MIN_MATCH. Value
+// 15 means that the length continues in the following bytes, which
+// are added to it until a byte other than 255. A match is given by
+// 2 byte little endian offset back from the current position and the
+// possible continuation of its length. The last sequence has only
+// literals.
+//
+#include <string.h>
+#include <vector>
+#include "compress.h"
+#include "error.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 14
+
+static inline unsigned int Read32(const unsigned char* p)
+{
+	unsigned int v;
+	memcpy(&v,p,4);
+	return v;
+}
+
+static inline unsigned int Hash(unsigned int v)
+{
+	return (v*2654435761U) >> (32-HASH_BITS);
+}
+
+// Append 'n' without the part stored in a token.
+static void AppendLength(string& out,size_t n)
+{
+	n-=15;
+	while(n >= 255)
+	{
+		out+=char(255);
+		n-=255;
+	}
+	out+=char(n);
+}
+
+// Append a sequence of 'literals' bytes from 'src' followed by a match.
+// Match length 0 means no match.
+static void AppendSequence(string& out,const unsigned char* src,size_t literals,size_t offset,size_t match)
+{
+	size_t m=match ? match-MIN_MATCH : 0;
+	out+=char(((literals < 15 ? literals : 15) << 4) | (m < 15 ? m : 15));
+	if(literals >= 15)
+		AppendLength(out,literals);
+	out.append((const char*)src,literals);
+
+	if(match)
+	{
+		out+=char(offset & 0xff);
+		out+=char(offset >> 8);
+		if(m >= 15)
+			AppendLength(out,m);
+	}
+}
+
+void LZCompress(const char* _src,size_t size,string& out)
+{
+	const unsigned char* src=(const unsigned char*)_src;
+
+	out+=char(size >> 24);
+	out+=char(size >> 16);
+	out+=char(size >> 8);
+	out+=char(size);
+
+	// Latest position of each hashed 4 byte sequence plus one.
+	vector<size_t> table(1 << HASH_BITS,0);
+	size_t anchor=0,i=0;
+
+	while(i+MIN_MATCH <= size)
+	{
+		unsigned int v=Read32(src+i);
+		unsigned int h=Hash(v);
+		size_t ref=table[h];
+		table[h]=i+1;
+
+		if(ref && i+1-ref <= MAX_OFFSET && Read32(src+ref-1)==v)
+		{
+			ref--;
+			size_t len=MIN_MATCH;
+			while(i+len < size && src[ref+len]==src[i+len])
+				len++;
+
+			AppendSequence(out,src+anchor,i-anchor,i-ref,len);
+			i+=len;
+			anchor=i;
+		}
+		else
+			// Skip faster through data which does not compress.
+			i+=1+((i-anchor) >> 6);
+	}
+
+	AppendSequence(out,src+anchor,size-anchor,0,0);
+}
+
+// Read the continuation of a length.
+static size_t ReadLength(const unsigned char*& src,const unsigned char* end)
+{
+	size_t n=15;
+	unsigned char c;
+	do
+	{
+		if(src >= end)
+			throw Error::Invalid("LZDecompress","truncated length");
+		c=*src++;
+		n+=c;
+	} while(c==255);
+
+	return n;
+}
+
+void LZDecompress(const char* _src,size_t size,string& out,size_t max_size)
+{
+	const unsigned char* src=(const unsigned char*)_src;
+	const unsigned char* end=src+size;
+
+	if(size < 4)
+		throw Error::Invalid("LZDecompress","truncated header");
+	size_t length=(size_t(src[0]) << 24) | (size_t(src[1]) << 16) | (size_t(src[2]) << 8) | size_t(src[3]);
+	src+=4;
+	if(length > max_size)
+		throw Error::Invalid("LZDecompress","data too long");
+
+	size_t start=out.size();
+	out.reserve(start+length);
+
+	while(1)
+	{
+		if(src >= end)
+			throw Error::Invalid("LZDecompress","truncated sequence");
+		unsigned char token=*src++;
+
+		size_t literals=token >> 4;
+		if(literals==15)
+			literals=ReadLength(src,end);
+		if(size_t(end-src) < literals || out.size()-start+literals > length)
+			throw Error::Invalid("LZDecompress","invalid literals");
+		out.append((const char*)src,literals);
+		src+=literals;
+
+		if(src==end)
+			break;
+
+		if(end-src < 2)
+			throw Error::Invalid("LZDecompress","truncated offset");
+		size_t offset=src[0] | (size_t(src[1]) << 8);
+		src+=2;
+		size_t match=token & 15;
+		if(match==15)
+			match=ReadLength(src,end);
+		match+=MIN_MATCH;
+
+		size_t pos=out.size();
+		if(offset==0 || offset > pos-start || pos-start+match > length)
+			throw Error::Invalid("LZDecompress","invalid match");
+
+		// Copy byte by byte, since the match may overlap itself.
+		out.resize(pos+match);
+		char* o=&out[0];
+		for(size_t k=0; k<match; k++)
+			o[pos+k]=o[pos-offset+k];
+	}
+
+	if(out.size()-start != length)
+		throw Error::Invalid("LZDecompress","invalid length");
+}
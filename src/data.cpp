@@ -49,6 +49,8 @@ namespace Evaluator
 
     size_t Data::KeyLookup(const Data& key,bool& already_exist) const
     {
+	// Use read access, which does not copy a shared vector.
+	const cow_vector<Data>& vec=this->vec;
 	size_t min=0;
 	size_t max=vec.size();
 	size_t i=0;
@@ -208,6 +210,46 @@ namespace Evaluator
 	return ret;
     }
 
+    bool IsDeleted(const Data& member,const vector<Data>& keys)
+    {
+	if(member.IsList(2))
+	    return binary_search(keys.begin(),keys.end(),member[0]);
+
+	return binary_search(keys.begin(),keys.end(),member);
+    }
+
+    size_t Data::DelEntries(const Data& keys)
+    {
+	if(!IsList())
+	    throw Error::Invalid("DelEntries(const Data&)","Not a list");
+	if(!keys.IsList())
+	    throw Error::Invalid("DelEntries(const Data&)","Key list expected");
+
+	const cow_vector<Data>& K=keys.vec;
+	vector<Data> sorted(K.begin(),K.end());
+	std::sort(sorted.begin(),sorted.end());
+
+	// Find the first deleted member without copying a shared vector.
+	const cow_vector<Data>& read=vec;
+	size_t i=0;
+	while(i < read.size() && !IsDeleted(read[i],sorted))
+	    i++;
+	if(i==read.size())
+	    return 0;
+
+	// Move remaining members over the deleted ones.
+	vector<Data>& V=vec.ref();
+	size_t n=i;
+	for(i++; i<V.size(); i++)
+	    if(!IsDeleted(V[i],sorted))
+		V[n++]=V[i];
+
+	size_t deleted=V.size()-n;
+	V.erase(V.begin()+n,V.end());
+
+	return deleted;
+    }
+
     bool Data::DelEntry(const Data& entry)
     {
 	if(!IsList())
@@ -20,6 +20,7 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #if !defined(__BCPLUSPLUS__) && !defined(_MSC_VER)
 # include <unistd.h>
 #elif !defined(_MSC_VER)
@@ -31,7 +32,15 @@
 #else
 # include <dirent.h>
 #endif
+#if !defined(WIN32)
+# include <sys/mman.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
 #include <fstream>
+#include <sstream>
 #include "security.h"
 #include "carddata.h"
 #include "data_filedb.h"
@@ -75,6 +84,97 @@ namespace Evaluator
 	}
 #endif
 	
+	// Key index file
+	// ==============
+
+	/// Header of the key index file.
+	struct DBIndexHeader
+	{
+		/// File format identifier.
+		char magic[8];
+		/// Number of entries.
+		unsigned int count;
+		/// Total length of the key strings.
+		unsigned int pool;
+		/// Size of the 'keys' file this index was made for.
+		unsigned int keys_size;
+		/// Modification time of the 'keys' file this index was made for.
+		unsigned int keys_mtime;
+		/// Checksum of the 'keys' file this index was made for.
+		unsigned int keys_checksum;
+	};
+
+	/// Entry of the key index file. Entries are followed by the key strings.
+	struct DBIndexRecord
+	{
+		/// Offset of the key string in the string pool.
+		unsigned int offset;
+		/// Length of the key string.
+		unsigned int length;
+		/// Size of the entry file.
+		unsigned int size;
+		/// Checksum of the entry file or 0 if not known.
+		unsigned int checksum;
+	};
+
+	static const char index_magic[8]={'G','C','C','G','I','D','X','2'};
+
+	/// Compute FNV-1a checksum of a string. Zero is reserved for unknown checksum.
+	static unsigned int Checksum(const string& s)
+	{
+		unsigned int h=2166136261U;
+
+		for(size_t i=0; i<s.length(); i++)
+		{
+			h^=(unsigned char)s[i];
+			h*=16777619U;
+		}
+
+		return h ? h : 1;
+	}
+
+	/// Compute checksum of the content of a file or return 0 if it cannot be read.
+	static unsigned int FileChecksum(const string& filename)
+	{
+		ifstream F(filename.c_str(),ios::in | ios::binary);
+		if(!F)
+			return 0;
+
+		ostringstream content;
+		content << F.rdbuf();
+
+		return Checksum(content.str());
+	}
+
+	/// Force a file or a directory to the disk, so that it survives a
+	/// power loss. Renaming a file is made durable by syncing it's directory.
+	static void SyncFile(const string& filename)
+	{
+#if !defined(WIN32)
+		int fd=open(filename.c_str(),O_RDONLY);
+		if(fd < 0)
+			throw Error::IO("SyncFile(const string&)","unable to open "+filename);
+
+		int ret=fsync(fd);
+		close(fd);
+		if(ret!=0)
+			throw Error::IO("SyncFile(const string&)","unable to sync "+filename);
+#endif
+	}
+
+	/// Defer syncing of directories to the end of a save. Flag is
+	/// cleared even if the save fails.
+	class SyncBatch
+	{
+		bool& active;
+
+	  public:
+		SyncBatch(bool& flag) : active(flag)
+			{active=true;}
+		~SyncBatch()
+			{active=false;}
+	};
+
 	// Construct & Destruct
 	// ====================
 	
@@ -87,6 +187,9 @@ namespace Evaluator
 	
 		dbtype=DBNone;
 		dir="";
+		index_data=0;
+		index_length=0;
+		sync_later=false;
 
 		Dump("DataFileDB()","create empty");
 	}
@@ -100,6 +203,9 @@ namespace Evaluator
 		
 		dbtype=src.dbtype;
 		dir="";
+		index_data=0;
+		index_length=0;
+		sync_later=false;
 		
 		Dump("DataFileDB(const DataFileDB&)","create from",src);
 
@@ -110,6 +216,7 @@ namespace Evaluator
 	DataFileDB::~DataFileDB()
 	{
 		SaveContent();
+		ReleaseIndex();
 		Dump("~DataFileDB()","destruct");
 	}
 
@@ -124,6 +231,8 @@ namespace Evaluator
 			return DBSingleFile;
 		else if(s=="DBStringKeys")
 			return DBStringKeys;
+		else if(s=="DBVector")
+			return DBVector;
 		else
 			throw Error::Invalid("DataFileDB::StringToType(FileDBType)","invalid type '"+s+"'");
 	}
@@ -136,6 +245,8 @@ namespace Evaluator
 			return "DBSingleFile";
 		else if(t==DBStringKeys)
 			return "DBStringKeys";
+		else if(t==DBVector)
+			return "DBVector";
 		else
 			throw Error::Invalid("DataFileDB::TypeToString(FileDBType)","invalid type "+ToString(int(t)));
 	}
@@ -164,34 +275,87 @@ namespace Evaluator
 	void DataFileDB::WriteFile(const string& filename,const string& s) const
 	{
 		string f=dir+"/"+filename;
+		string tmp=f+".tmp";
 
-		ofstream F(f.c_str());
+		ofstream F(tmp.c_str());
 		if(!F)
-			throw Error::IO("DataFileDB::WriteFile(const string&,const string&)","unable to write '"+f+"'");
+			throw Error::IO("DataFileDB::WriteFile(const string&,const string&)","unable to write '"+tmp+"'");
 
 		F << s;
 		F << endl;
+		F.close();
+		if(!F)
+			throw Error::IO("DataFileDB::WriteFile(const string&,const string&)","unable to write '"+tmp+"'");
+		SyncFile(tmp);
+
+#ifdef WIN32
+		unlink(f.c_str());
+#endif
+		if(rename(tmp.c_str(),f.c_str())!=0)
+			throw Error::IO("DataFileDB::WriteFile(const string&,const string&)","unable to rename '"+tmp+"'");
+		SyncDir(dir);
+	}
+
+	void DataFileDB::SyncDir(const string& path) const
+	{
+		if(sync_later)
+			unsynced.insert(path);
+		else
+			SyncFile(path);
+	}
+
+	void DataFileDB::SyncDirs() const
+	{
+		while(unsynced.size())
+		{
+			SyncFile(*unsynced.begin());
+			unsynced.erase(unsynced.begin());
+		}
+	}
+
+	void DataFileDB::Journal(int index) const
+	{
+		string name=EntryFileName(index).substr(dir.length()+6);
+		if(!journaled.insert(name).second)
+			return;
+
+		string filename=dir+"/journal";
+		security.WriteFile(filename);
+
+		ofstream F(filename.c_str(),ios::out | ios::app);
+		if(F)
+		{
+			F << name << endl;
+			F.close();
+		}
+		if(!F)
+			throw Error::IO("DataFileDB::Journal(int)","unable to write "+filename);
+
+		// The journal must be on the disk before the entry is replaced.
+		SyncFile(filename);
+		if(journaled.size()==1)
+			SyncFile(dir);
 	}
 	
 	// Database operations
 	// ===================
 	
-	void DataFileDB::Attach(const Data& init, const string& variablename,FileDBType type)
+	void DataFileDB::Attach(const Data& init, const string& directory, const string& variablename,FileDBType type)
 	{
-		dir=savedir+"/"+variablename+"-db";
+		dir=directory+"/"+variablename+"-db";
 		dbtype=DatabaseExist();
 
 		security.WriteFile(dir);
 
 		if(dbtype!=DBNone)
 		{
-			Dump("DataFileDB::Attach(const Data&, const string&, FileDBType)","load old",init);
+			Dump("DataFileDB::Attach(const Data&, const string&, const string&, FileDBType)","load old",init);
 			LoadContent();
 		}
 		else
 		{
 			dbtype=type;
-			Dump("DataFileDB::Attach(const Data&, const string&, FileDBType)","create new",init);
+			Dump("DataFileDB::Attach(const Data&, const string&, const string&, FileDBType)","create new",init);
 			CreateEmpty();
 			DataFileDB::operator=(init);
 			MarkAllDirty();
@@ -225,9 +389,30 @@ namespace Evaluator
 		}
 		else if(dbtype==DBStringKeys)
 		{
-			unlink((dir+"/keys").c_str());
+			// Leave an empty database behind until the new content is saved.
+			WriteFile("keys","(,)");
+			unlink((dir+"/index").c_str());
 			for(size_t i=0; i<vec.size(); i++)
-				unlink(FileName(vec[i][0].String()).c_str());
+				unlink(FileName(KeyString(i)).c_str());
+			for(set<string>::const_iterator k=deleted_keys.begin(); k!=deleted_keys.end(); k++)
+				unlink(FileName(*k).c_str());
+			deleted_keys.clear();
+
+			map<string,DBSecondaryIndex>::iterator j;
+			for(j=secondary.begin(); j!=secondary.end(); j++)
+			{
+				unlink(SecondaryFileName(j->first).c_str());
+				j->second.postings.clear();
+				j->second.entries.clear();
+				j->second.saved=false;
+			}
+			secondary_pending.clear();
+		}
+		else if(dbtype==DBVector)
+		{
+			WriteFile("size","0");
+			for(size_t i=0; i<status.size(); i++)
+				unlink(EntryFileName(i).c_str());
 		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::DestroyContent()");
@@ -269,6 +454,22 @@ namespace Evaluator
 			status=vector<DBEntryStatus>();
 			MakeList();
 		}
+		else if(dbtype==DBVector)
+		{
+#ifdef WIN32
+			_mkdir(dir.c_str());
+			_mkdir((dir+"/data").c_str());
+#else
+			mkdir(dir.c_str(),0700);
+			mkdir((dir+"/data").c_str(),0700);
+#endif
+
+			WriteFile("type",TypeToString(dbtype));
+			WriteFile("size","0");
+
+			status=vector<DBEntryStatus>();
+			MakeList();
+		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::CreateEmpty()");
 	}
@@ -283,22 +484,134 @@ namespace Evaluator
 		}
 		else if(dbtype==DBStringKeys)
 		{
-			Data keys=toval(ReadFile("keys"));
-			status=vector<DBEntryStatus>(keys.Size());
-			MakeList(keys.Size());
-			
-			for(size_t i=0; i<vec.size(); i++)
+			if(LoadIndex())
+				Dump("LoadContent()","using key index");
+			else
 			{
-				vec[i]=keys[i];
-				status[i].ondisk=true;
+				// Index is missing or out of date. Read the keys and
+				// rebuild the index from the data directory.
+				Data keys=toval(ReadFile("keys"));
+				status=vector<DBEntryStatus>(keys.Size());
+				MakeList(keys.Size());
+
+				struct stat entry_stat;
+				for(size_t i=0; i<vec.size(); i++)
+				{
+					vec[i]=keys[i];
+					status[i].ondisk=true;
+					if(stat(FileName(vec[i][0].String()).c_str(),&entry_stat)==0)
+						status[i].size=entry_stat.st_size;
+				}
+
+				SaveIndex();
 			}
 		}
+		else if(dbtype==DBVector)
+		{
+			size_t size=toval(ReadFile("size")).Integer();
+			MakeList(size);
+			status=vector<DBEntryStatus>((size+DB_PAGE_SIZE-1)/DB_PAGE_SIZE);
+
+			for(size_t i=0; i<status.size(); i++)
+				status[i].ondisk=true;
+		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::LoadContent()");
 
+		if(FileExist(dir+"/journal"))
+			Recover();
+
 		Dump("LoadContent()","load old data");
 	}
 
+	void DataFileDB::Recover()
+	{
+		Dump("Recover()","recover entries from the journal");
+
+		string filename=dir+"/journal";
+		security.ReadFile(filename);
+		ifstream F(filename.c_str());
+
+		set<string> names;
+		string name;
+		while(F >> name)
+		{
+			names.insert(name);
+			unlink((dir+"/data/"+name+".tmp").c_str());
+		}
+		F.close();
+
+		set<string>::const_iterator i;
+		struct stat entry_stat;
+
+		if(dbtype==DBStringKeys)
+		{
+			// Add entries written after the keys were saved and
+			// forget checksums of entries rewritten since then.
+			for(i=names.begin(); i!=names.end(); i++)
+			{
+				string key;
+				if(*i!="[empty_string]")
+				{
+					try
+					{
+						key=HexDecode(*i);
+					}
+					catch(Error::Invalid)
+					{
+						continue;
+					}
+				}
+
+				bool found;
+				size_t pos=FindPosition(key,found);
+				if(stat(FileName(key).c_str(),&entry_stat)!=0)
+					continue;
+
+				if(!found)
+				{
+					MaterializeAll();
+					Data::InsertAt(pos,Data(key,Null));
+					status.insert(status.begin()+pos,DBEntryStatus());
+				}
+
+				status[pos].ondisk=true;
+				status[pos].size=entry_stat.st_size;
+				status[pos].checksum=0;
+			}
+		}
+		else if(dbtype==DBVector)
+		{
+			// Find the last page and count it's elements.
+			int last=(int)status.size()-1;
+			for(i=names.begin(); i!=names.end(); i++)
+				last=::max(last,atoi(i->c_str()));
+			while(last >= 0 && !FileExist(dir+"/data/"+ToString(last)))
+				last--;
+
+			size_t size=0;
+			if(last >= 0)
+			{
+				string pagefile=dir+"/data/"+ToString(last);
+				security.ReadFile(pagefile);
+				ifstream P(pagefile.c_str());
+				ostringstream content;
+				content << P.rdbuf();
+				string buffer=content.str();
+				buffer.erase(remove(buffer.begin(),buffer.end(),'\n'),buffer.end());
+				size=last*DB_PAGE_SIZE+toval(buffer).Size();
+			}
+
+			MakeList(size);
+			status=vector<DBEntryStatus>((size+DB_PAGE_SIZE-1)/DB_PAGE_SIZE);
+			for(size_t j=0; j<status.size(); j++)
+				status[j].ondisk=true;
+		}
+
+		// Save the repaired keys and remove the journal.
+		SaveToDisk();
+	}
+
 	void DataFileDB::SaveContent()
 	{
 		if(IsDirty())
@@ -308,24 +621,75 @@ namespace Evaluator
 	void DataFileDB::SaveToDisk()
 	{
 		Dump("SaveToDisk()","save all data");
+
+		// Renamed files are synced first and their directories once.
+		SyncBatch batch(sync_later);
 		
 		if(dbtype==DBSingleFile)
 		{
 			WriteFile("type",TypeToString(DBSingleFile));
 			WriteFile("value",tostr(*this).String());
+			SyncDirs();
 		}
 		else if(dbtype==DBStringKeys)
 		{
 			WriteFile("type",TypeToString(DBStringKeys));
+			SecondaryUpdate();
+
 			Data keys;
 			keys.MakeList(status.size());
 			for(size_t i=0; i<status.size(); i++)
 			{
 				keys[i].MakeList(2);
-				keys[i][0]=vec[i][0];
-				SaveCache(i);
+				keys[i][0]=KeyString(i);
+				if(status[i].pinned)
+				{
+					if(!status[i].ondisk)
+						WriteCache(i);
+				}
+				else
+					SaveCache(i);
+			}
+			WriteFile("keys",tostr(keys).String());
+			SaveIndex();
+
+			map<string,DBSecondaryIndex>::iterator j;
+			for(j=secondary.begin(); j!=secondary.end(); j++)
+				SecondarySave(j->second,j->first);
+			SyncDirs();
+
+			// Files of deleted entries are not needed once the keys
+			// are on the disk, unless the key has been added again.
+			for(set<string>::const_iterator k=deleted_keys.begin(); k!=deleted_keys.end(); k++)
+			{
+				bool found;
+				FindPosition(*k,found);
+				if(!found)
+					unlink(FileName(*k).c_str());
+			}
+			deleted_keys.clear();
+
+			unlink((dir+"/journal").c_str());
+			journaled.clear();
+		}
+		else if(dbtype==DBVector)
+		{
+			WriteFile("type",TypeToString(DBVector));
+			for(size_t i=0; i<status.size(); i++)
+			{
+				if(status[i].pinned)
+				{
+					if(!status[i].ondisk)
+						WriteCache(i);
+				}
+				else
+					SaveCache(i);
 			}
-			WriteFile("keys",tostr(keys).String());				
+			WriteFile("size",ToString(vec.size()));
+			SyncDirs();
+
+			unlink((dir+"/journal").c_str());
+			journaled.clear();
 		}
 		else
 			throw Error::NotYetImplemented("DataToDisk::SaveContent()");
@@ -342,9 +706,9 @@ namespace Evaluator
 			return false;
 		else if(dbtype==DBSingleFile)
 			return single_status.dirty;
-		else if(dbtype==DBStringKeys)
+		else if(dbtype==DBStringKeys || dbtype==DBVector)
 		{
-			if(status.size()==0)
+			if(status.size()==0 || deleted_keys.size())
 				return true;
 			
 			for(size_t i=0; i<status.size(); i++)
@@ -357,16 +721,22 @@ namespace Evaluator
 			throw Error::NotYetImplemented("DataFileDB::IsDirty()");
 	}
 
+	/// Last number given to an entry marked dirty by any database.
+	static unsigned int last_entry_revision=0;
+
 	void DataFileDB::MarkAllDirty()
 	{
 		if(dbtype==DBNone)
 			return;
 		else if(dbtype==DBSingleFile)
 			single_status.dirty=true;
-		else if(dbtype==DBStringKeys)
+		else if(dbtype==DBStringKeys || dbtype==DBVector)
 		{
 			for(size_t i=0; i<status.size(); i++)
+			{
 				status[i].dirty=true;
+				status[i].revision=++last_entry_revision;
+			}
 		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::MarkAllDirty()");
@@ -379,7 +749,7 @@ namespace Evaluator
 			return;
 		else if(dbtype==DBSingleFile)
 			single_status.dirty=false;
-		else if(dbtype==DBStringKeys)
+		else if(dbtype==DBStringKeys || dbtype==DBVector)
 		{
 			for(size_t i=0; i<status.size(); i++)
 				status[i].dirty=false;
@@ -395,12 +765,244 @@ namespace Evaluator
 			throw Error::IO("DataFileDB::MarkDirty(int)","cannot apply indices to database type DBNone");
 		else if(dbtype==DBSingleFile)
 			single_status.dirty=true;
-		else if(dbtype==DBStringKeys)
-			status[index].dirty=true;
+		else if(dbtype==DBStringKeys || dbtype==DBVector)
+		{
+			status[StatusIndex(index)].dirty=true;
+			status[StatusIndex(index)].revision=++last_entry_revision;
+			if(secondary.size())
+				SecondaryChanged(KeyString(index));
+		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::MarkDirty(int)");
 	}
 
+	vector<bool> DataFileDB::ResidentPages() const
+	{
+		vector<bool> ret(status.size());
+		for(size_t i=0; i<status.size(); i++)
+			ret[i]=!status[i].ondisk;
+
+		return ret;
+	}
+
+	void DataFileDB::ReleasePage(int page,bool resident)
+	{
+		if(!resident && !status[page].pinned)
+			SaveCache(page);
+	}
+
+	// Key index
+	// =========
+
+	bool DataFileDB::LoadIndex()
+	{
+		string indexfile=dir+"/index";
+		struct stat keys_stat,index_stat;
+
+		if(stat((dir+"/keys").c_str(),&keys_stat)!=0 || stat(indexfile.c_str(),&index_stat)!=0)
+			return false;
+		if((size_t)index_stat.st_size < sizeof(DBIndexHeader))
+			return false;
+
+		security.ReadFile(indexfile);
+
+		index_length=index_stat.st_size;
+#if !defined(WIN32)
+		int fd=open(indexfile.c_str(),O_RDONLY);
+		if(fd < 0)
+			return false;
+		void* map=mmap(0,index_length,PROT_READ,MAP_SHARED,fd,0);
+		close(fd);
+		if(map==MAP_FAILED)
+			return false;
+		index_data=(const char*)map;
+#else
+		ifstream F(indexfile.c_str(),ios::in | ios::binary);
+		if(!F)
+			return false;
+		char* buffer=new char[index_length];
+		F.read(buffer,index_length);
+		index_data=buffer;
+		if(!F)
+		{
+			ReleaseIndex();
+			return false;
+		}
+#endif
+
+		const DBIndexHeader* header=(const DBIndexHeader*)index_data;
+		const DBIndexRecord* record=(const DBIndexRecord*)(index_data+sizeof(DBIndexHeader));
+		size_t pool_start=sizeof(DBIndexHeader)+header->count*sizeof(DBIndexRecord);
+
+		// Size and time of the keys may match after a crash between
+		// saving the keys and the index, so compare the content, too.
+		if(memcmp(header->magic,index_magic,sizeof(index_magic))
+		  || header->keys_size!=(unsigned int)keys_stat.st_size
+		  || header->keys_mtime!=(unsigned int)keys_stat.st_mtime
+		  || pool_start+header->pool!=index_length
+		  || header->keys_checksum!=FileChecksum(dir+"/keys"))
+		{
+			ReleaseIndex();
+			return false;
+		}
+
+		status=vector<DBEntryStatus>(header->count);
+		MakeList(header->count);
+
+		for(size_t i=0; i<status.size(); i++)
+		{
+			if(record[i].offset+record[i].length > header->pool)
+			{
+				ReleaseIndex();
+				return false;
+			}
+			status[i].ondisk=true;
+			status[i].size=record[i].size;
+			status[i].checksum=record[i].checksum;
+		}
+
+		return true;
+	}
+
+	void DataFileDB::SaveIndex() const
+	{
+		struct stat keys_stat;
+		if(stat((dir+"/keys").c_str(),&keys_stat)!=0)
+			throw Error::IO("DataFileDB::SaveIndex()","unable to access "+dir+"/keys");
+
+		DBIndexHeader header;
+		vector<DBIndexRecord> record(status.size());
+		string pool,key;
+
+		for(size_t i=0; i<status.size(); i++)
+		{
+			key=KeyString(i);
+			record[i].offset=pool.length();
+			record[i].length=key.length();
+			record[i].size=status[i].size;
+			record[i].checksum=status[i].checksum;
+			pool+=key;
+		}
+
+		memcpy(header.magic,index_magic,sizeof(index_magic));
+		header.count=status.size();
+		header.pool=pool.length();
+		header.keys_size=keys_stat.st_size;
+		header.keys_mtime=keys_stat.st_mtime;
+		header.keys_checksum=FileChecksum(dir+"/keys");
+
+		// Replace the index with rename(), since the old one may be mapped.
+		string indexfile=dir+"/index";
+		string tmpfile=indexfile+".tmp";
+		security.WriteFile(tmpfile);
+		security.WriteFile(indexfile);
+
+		ofstream F(tmpfile.c_str(),ios::out | ios::binary);
+		if(!F)
+			throw Error::IO("DataFileDB::SaveIndex()","unable to write "+tmpfile);
+		F.write((const char*)&header,sizeof(header));
+		if(record.size())
+			F.write((const char*)&record[0],record.size()*sizeof(DBIndexRecord));
+		F.write(pool.data(),pool.length());
+		F.close();
+		if(!F)
+			throw Error::IO("DataFileDB::SaveIndex()","unable to write "+tmpfile);
+		SyncFile(tmpfile);
+
+#ifdef WIN32
+		unlink(indexfile.c_str());
+#endif
+		if(rename(tmpfile.c_str(),indexfile.c_str())!=0)
+			throw Error::IO("DataFileDB::SaveIndex()","unable to rename "+tmpfile);
+		SyncDir(dir);
+	}
+
+	void DataFileDB::ReleaseIndex()
+	{
+		if(!index_data)
+			return;
+
+#if !defined(WIN32)
+		munmap((void*)index_data,index_length);
+#else
+		delete[] index_data;
+#endif
+		index_data=0;
+		index_length=0;
+	}
+
+	string DataFileDB::KeyString(int index) const
+	{
+		if(index_data && vec[index].IsNull())
+		{
+			const DBIndexHeader* header=(const DBIndexHeader*)index_data;
+			const DBIndexRecord& record=((const DBIndexRecord*)(index_data+sizeof(DBIndexHeader)))[index];
+			const char* pool=index_data+sizeof(DBIndexHeader)+header->count*sizeof(DBIndexRecord);
+
+			return string(pool+record.offset,record.length);
+		}
+
+		return vec[index][0].String();
+	}
+
+	void DataFileDB::Materialize(int index) const
+	{
+		if(!index_data || !vec[index].IsNull())
+			return;
+
+		Data pair;
+		pair.MakeList(2);
+		pair[0]=KeyString(index);
+		vec[index]=pair;
+	}
+
+	void DataFileDB::MaterializeAll()
+	{
+		if(!index_data)
+			return;
+
+		for(size_t i=0; i<vec.size(); i++)
+			Materialize(i);
+
+		ReleaseIndex();
+	}
+
+	size_t DataFileDB::FindPosition(const Data& key,bool& found) const
+	{
+		if(!index_data)
+			return Data::KeyLookup(key,found);
+
+		const DBIndexHeader* header=(const DBIndexHeader*)index_data;
+		const DBIndexRecord* record=(const DBIndexRecord*)(index_data+sizeof(DBIndexHeader));
+		const char* pool=index_data+sizeof(DBIndexHeader)+header->count*sizeof(DBIndexRecord);
+		const string& k=key.String();
+
+		size_t min=0;
+		size_t max=header->count;
+		size_t i;
+		int cmp;
+
+		found=true;
+
+		while(min != max)
+		{
+			i=(max+min)/2;
+			cmp=k.compare(0,string::npos,pool+record[i].offset,record[i].length);
+
+			if(cmp==0)
+				return i;
+
+			if(cmp < 0)
+				max=i;
+			else
+				min=i+1;
+		}
+
+		found=false;
+
+		return min;
+	}
+
 	// Cache handling
 	// ==============
 	void DataFileDB::Touch(int index) const
@@ -418,34 +1020,64 @@ namespace Evaluator
 		
 		return dir+"/data/"+HexEncode(entry);
 	}
+
+	string DataFileDB::EntryFileName(int index) const
+	{
+		if(dbtype==DBVector)
+			return dir+"/data/"+ToString(index);
+
+		return FileName(KeyString(index));
+	}
 	
 	void DataFileDB::LoadCache(int index) const
 	{
 		if(index < 0 || (size_t)index >= status.size())
 			throw Error::Invalid("DataFileDB::LoadCache","invalid index "+ToString(index));
 		
-		if(dbtype==DBStringKeys)
+		if(dbtype==DBStringKeys || dbtype==DBVector)
 		{
 			Touch(index);
 		
 			if(!status[index].ondisk)
 				return;
 
-			Dump("DataFileDB::LoadCache(int)","loading entry "+ToString(index)+": "+tostr(vec[index][0]).String());
+			Materialize(index);
+
+			Dump("DataFileDB::LoadCache(int)","loading entry "+ToString(index)+": "+EntryFileName(index));
 				
-			string filename=FileName(vec[index][0].String());
+			string filename=EntryFileName(index);
 			security.ReadFile(filename);
 			ifstream F(filename.c_str());
 			if(!F)
 				throw Error::IO("DataFileDB::LoadCache(int)","unable to read "+filename);
 		
-			string buffer;
-			while(F)
-				buffer+=readline(F);
+			ostringstream content;
+			content << F.rdbuf();
 			F.close();
+
+			string buffer=content.str();
+			unsigned int checksum=Checksum(buffer);
+			if(status[index].checksum && status[index].checksum!=checksum)
+				throw Error::IO("DataFileDB::LoadCache(int)","checksum mismatch in "+filename);
+			status[index].size=buffer.length();
+			status[index].checksum=checksum;
+			buffer.erase(remove(buffer.begin(),buffer.end(),'\n'),buffer.end());
 		
 			status[index].ondisk=false;
-			vec[index][1]=toval(buffer);
+
+			if(dbtype==DBStringKeys)
+				vec[index][1]=toval(buffer);
+			else
+			{
+				Data page=toval(buffer);
+				size_t first=index*DB_PAGE_SIZE;
+
+				if(!page.IsList() || first+page.Size() > vec.size())
+					throw Error::IO("DataFileDB::LoadCache(int)","invalid page "+filename);
+
+				for(size_t i=0; i<page.Size(); i++)
+					vec[first+i]=page[i];
+			}
 		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::LoadCache()");
@@ -461,39 +1093,114 @@ namespace Evaluator
 			if(status[index].ondisk)
 				return false;
 
-			Dump("DataFileDB::SaveCache(int)","saving entry "+ToString(index)+": "+tostr(vec[index][0]).String());
-		
-			Touch(index);
+			if(secondary_pending.size())
+				SecondaryUpdate(KeyString(index));
 
-			string filename=FileName(vec[index][0].String());
-			security.WriteFile(filename);
-		
-			ofstream F(filename.c_str());
-			if(!F)
-				throw Error::IO("DataFileDB::SaveCache(int)","unable to write "+filename);
-			PrettySave(F,vec[index][1]);
-			F.close();
+			Touch(index);
+			WriteCache(index);
 
 			status[index].ondisk=true;
 			vec[index][1]=Null;
 		}
+		else if(dbtype==DBVector)
+		{
+			if(status[index].ondisk)
+				return false;
+
+			Touch(index);
+			if(status[index].dirty)
+				WriteCache(index);
+
+			status[index].ondisk=true;
+
+			size_t last=::min((index+1)*DB_PAGE_SIZE,(int)vec.size());
+			for(size_t i=index*DB_PAGE_SIZE; i<last; i++)
+				vec[i]=Null;
+		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::SaveCache()");
 		
 		return true;
 	}
 
-	int DataFileDB::Oldest() const
-        {
-            time_t oldest;
-            int oldest_index=-1;
+	void DataFileDB::WriteCache(int index) const
+	{
+		if(dbtype==DBStringKeys || dbtype==DBVector)
+		{
+			Dump("DataFileDB::WriteCache(int)","saving entry "+ToString(index)+": "+EntryFileName(index));
 
-            ::time(&oldest);
-            oldest++;
+			string filename=EntryFileName(index);
+			string tmpfile=filename+".tmp";
+			security.WriteFile(tmpfile);
+			security.WriteFile(filename);
+
+			ostringstream content;
+			if(dbtype==DBStringKeys)
+				PrettySave(content,vec[index][1]);
+			else
+			{
+				size_t first=index*DB_PAGE_SIZE;
+				size_t last=::min(first+DB_PAGE_SIZE,vec.size());
+				Data page;
+				page.MakeList(last-first);
+				for(size_t i=first; i<last; i++)
+					page[i-first]=vec[i];
+				PrettySave(content,page);
+			}
+			string buffer=content.str();
+		
+			// Write a temporary file and rename it over the old
+			// entry, so that a crash never leaves a partial entry.
+			ofstream F(tmpfile.c_str());
+			if(!F)
+				throw Error::IO("DataFileDB::WriteCache(int)","unable to write "+tmpfile);
+			F << buffer;
+			F.close();
+			if(!F)
+				throw Error::IO("DataFileDB::WriteCache(int)","unable to write "+tmpfile);
+			SyncFile(tmpfile);
+
+			Journal(index);
+#ifdef WIN32
+			unlink(filename.c_str());
+#endif
+			if(rename(tmpfile.c_str(),filename.c_str())!=0)
+				throw Error::IO("DataFileDB::WriteCache(int)","unable to rename "+tmpfile);
+			SyncDir(dir+"/data");
+
+			status[index].size=buffer.length();
+			status[index].checksum=Checksum(buffer);
+		}
+		else
+			throw Error::NotYetImplemented("DataFileDB::WriteCache()");
+	}
+
+	void DataFileDB::ReadAhead(int index) const
+	{
+#ifdef POSIX_FADV_WILLNEED
+		string filename=EntryFileName(index);
+		security.ReadFile(filename);
+
+		int fd=open(filename.c_str(),O_RDONLY);
+		if(fd >= 0)
+		{
+			posix_fadvise(fd,0,0,POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+#endif
+	}
+
+	int DataFileDB::Oldest() const
+        {
+            time_t oldest;
+            int oldest_index=-1;
+
+            ::time(&oldest);
+            oldest++;
 
             for(size_t i=0; i<status.size(); i++)
             {
-                if(!status[i].ondisk && status[i].access < oldest)
+                if(!status[i].ondisk && !status[i].pinned && status[i].access < oldest)
                 {
                     oldest=status[i].access;
                     oldest_index=i;
@@ -521,7 +1228,7 @@ namespace Evaluator
 		static bool first_update=true;
 		static time_t last_update;
 
-		if(dbtype==DBStringKeys)
+		if(dbtype==DBStringKeys || dbtype==DBVector)
 		{
 			// Check if it is too early to update.
 			if(first_update)
@@ -586,6 +1293,507 @@ namespace Evaluator
 			throw Error::NotYetImplemented("DataFileDB::CacheUpdate()");
 	}
 
+	// Prefetching and pinning
+	// =======================
+
+	int DataFileDB::EntryIndex(const Data& key) const
+	{
+		if(dbtype==DBVector)
+		{
+			if(!key.IsInteger())
+				throw LangErr("DataFileDB::EntryIndex(const Data&)","invalid index type "+type_of(key).String()+" for DBVector");
+
+			int i=key.Integer();
+
+			return (i >= 0 && i < (int)vec.size()) ? StatusIndex(i) : -1;
+		}
+
+		if(!key.IsString())
+			throw LangErr("DataFileDB::EntryIndex(const Data&)","invalid key type "+type_of(key).String()+" for DBStringKeys");
+
+		bool found;
+		size_t pos=FindPosition(key,found);
+
+		return found ? int(pos) : -1;
+	}
+
+	int DataFileDB::Prefetch(const Data& keys)
+	{
+		if(dbtype==DBNone)
+			throw LangErr("DataFileDB::Prefetch(const Data&)","cannot prefetch from database type DBNone");
+		else if(dbtype==DBSingleFile)
+			return 0;
+		else if(dbtype==DBStringKeys || dbtype==DBVector)
+		{
+			if(!keys.IsList())
+				return Prefetch(Data(vector<Data>(1,keys)));
+
+			// Issue all reads before parsing any of them, so that disk
+			// latencies overlap instead of adding up.
+			vector<int> found,pending;
+			for(size_t i=0; i<keys.Size(); i++)
+			{
+				int index=EntryIndex(keys[i]);
+				if(index < 0)
+					continue;
+
+				found.push_back(index);
+				if(status[index].ondisk)
+				{
+					ReadAhead(index);
+					pending.push_back(index);
+				}
+			}
+
+			for(size_t i=0; i<pending.size(); i++)
+				LoadCache(pending[i]);
+
+			Dump("DataFileDB::Prefetch(const Data&)","prefetched "+ToString(pending.size())+" entries");
+
+			// Do not let the cache update evict the requested entries.
+			for(size_t i=0; i<found.size(); i++)
+				status[found[i]].pinned++;
+			CacheUpdate();
+			for(size_t i=0; i<found.size(); i++)
+				status[found[i]].pinned--;
+
+			return (int)pending.size();
+		}
+		else
+			throw Error::NotYetImplemented("DataFileDB::Prefetch(const Data&)");
+	}
+
+	int DataFileDB::Pin(const Data& keys)
+	{
+		if(dbtype==DBNone)
+			throw LangErr("DataFileDB::Pin(const Data&)","cannot pin entries of database type DBNone");
+		else if(dbtype==DBSingleFile)
+			return 0;
+		else if(dbtype==DBStringKeys || dbtype==DBVector)
+		{
+			if(!keys.IsList())
+				return Pin(Data(vector<Data>(1,keys)));
+
+			Prefetch(keys);
+
+			int count=0;
+			for(size_t i=0; i<keys.Size(); i++)
+			{
+				int index=EntryIndex(keys[i]);
+				if(index >= 0)
+				{
+					LoadCache(index);
+					status[index].pinned++;
+					count++;
+				}
+			}
+
+			return count;
+		}
+		else
+			throw Error::NotYetImplemented("DataFileDB::Pin(const Data&)");
+	}
+
+	int DataFileDB::Unpin(const Data& keys)
+	{
+		if(dbtype==DBNone)
+			throw LangErr("DataFileDB::Unpin(const Data&)","cannot unpin entries of database type DBNone");
+		else if(dbtype==DBSingleFile)
+			return 0;
+		else if(dbtype==DBStringKeys || dbtype==DBVector)
+		{
+			if(!keys.IsList())
+				return Unpin(Data(vector<Data>(1,keys)));
+
+			int count=0;
+			for(size_t i=0; i<keys.Size(); i++)
+			{
+				int index=EntryIndex(keys[i]);
+				if(index >= 0 && status[index].pinned)
+				{
+					status[index].pinned--;
+					count++;
+				}
+			}
+
+			return count;
+		}
+		else
+			throw Error::NotYetImplemented("DataFileDB::Unpin(const Data&)");
+	}
+
+	// Secondary indices
+	// =================
+
+	/// Follow the path of the index from the entry value. Return the
+	/// indexed dictionary or NULL if there is no such list.
+	static const Data* SecondaryTarget(const Data& path,const Data& value)
+	{
+		const Data* target=&value;
+
+		for(size_t i=0; i<path.Size(); i++)
+		{
+			if(!target->IsList())
+				return 0;
+
+			if(path[i].IsInteger())
+			{
+				int n=path[i].Integer();
+				if(n < 0 || n >= (int)target->Size())
+					return 0;
+				target=&(*target)[n];
+			}
+			else
+				target=&(*target)[path[i]];
+		}
+
+		return target->IsList() ? target : 0;
+	}
+
+	/// Check if a dictionary value satisfies the condition of the index.
+	static bool SecondaryCondition(const DBSecondaryIndex& index,const Data& value)
+	{
+		const Data* x=&value;
+
+		if(index.field >= 0)
+		{
+			if(!value.IsList() || index.field >= (int)value.Size())
+				return false;
+			x=&value[index.field];
+		}
+
+		if(index.op=="")
+			return true;
+		else if(index.op=="==")
+			return *x==index.value;
+		else if(index.op=="!=")
+			return *x!=index.value;
+		else if(index.op=="<")
+			return *x < index.value;
+		else if(index.op==">")
+			return *x > index.value;
+		else if(index.op=="<=")
+			return !(*x > index.value);
+		else
+			return !(*x < index.value);
+	}
+
+	void DataFileDB::SecondaryChanged(const string& key) const
+	{
+		if(secondary.empty())
+			return;
+
+		secondary_pending.insert(key);
+
+		map<string,DBSecondaryIndex>::iterator i;
+		for(i=secondary.begin(); i!=secondary.end(); i++)
+			if(i->second.saved)
+			{
+				unlink(SecondaryFileName(i->first).c_str());
+				i->second.saved=false;
+			}
+	}
+
+	void DataFileDB::SecondaryEntry(DBSecondaryIndex& index,const string& key,const Data* value) const
+	{
+		set<Data> found;
+		const Data* target=value ? SecondaryTarget(index.path,*value) : 0;
+
+		if(target)
+			for(size_t i=0; i<target->Size(); i++)
+			{
+				const Data& pair=(*target)[i];
+				if(pair.IsList(2) && SecondaryCondition(index,pair[1]))
+					found.insert(pair[0]);
+			}
+
+		set<Data>& old=index.entries[key];
+		set<Data>::const_iterator i;
+
+		for(i=old.begin(); i!=old.end(); i++)
+			if(found.find(*i)==found.end())
+			{
+				map<Data,set<string> >::iterator p=index.postings.find(*i);
+				p->second.erase(key);
+				if(p->second.empty())
+					index.postings.erase(p);
+			}
+		for(i=found.begin(); i!=found.end(); i++)
+			if(old.find(*i)==old.end())
+				index.postings[*i].insert(key);
+
+		if(found!=old)
+			index.revision[key]++;
+
+		if(found.empty())
+			index.entries.erase(key);
+		else
+			old.swap(found);
+	}
+
+	void DataFileDB::SecondaryUpdate(const string& key) const
+	{
+		if(secondary_pending.erase(key)==0)
+			return;
+
+		bool found;
+		size_t pos=FindPosition(key,found);
+		const Data* value=0;
+
+		if(found)
+		{
+			LoadCache(pos);
+			value=&vec[pos][1];
+		}
+
+		map<string,DBSecondaryIndex>::iterator i;
+		for(i=secondary.begin(); i!=secondary.end(); i++)
+			SecondaryEntry(i->second,key,value);
+	}
+
+	void DataFileDB::SecondaryUpdate() const
+	{
+		while(secondary_pending.size())
+			SecondaryUpdate(*secondary_pending.begin());
+	}
+
+	bool DataFileDB::SecondaryLoad(DBSecondaryIndex& index,const string& name)
+	{
+		string filename=SecondaryFileName(name);
+		struct stat keys_stat;
+
+		if(stat((dir+"/keys").c_str(),&keys_stat)!=0 || !FileExist(filename.c_str()))
+			return false;
+
+		security.ReadFile(filename);
+		ifstream F(filename.c_str());
+		if(!F)
+			return false;
+
+		ostringstream content;
+		content << F.rdbuf();
+		string buffer=content.str();
+		buffer.erase(remove(buffer.begin(),buffer.end(),'\n'),buffer.end());
+
+		// The file contains (definition,(keys size,keys mtime,keys
+		// checksum),postings). A damaged file is rebuilt like an
+		// outdated one.
+		Data data;
+		try
+		{
+			data=toval(buffer);
+		}
+		catch(Error::General e)
+		{
+			return false;
+		}
+		if(!data.IsList(3) || data[0]!=index.Definition() || data[1]!=Data((int)keys_stat.st_size,(int)keys_stat.st_mtime,(int)FileChecksum(dir+"/keys")) || !data[2].IsList())
+			return false;
+
+		const Data& postings=data[2];
+		for(size_t i=0; i<postings.Size(); i++)
+		{
+			if(!postings[i].IsList(2) || !postings[i][1].IsList())
+				return false;
+			for(size_t j=0; j<postings[i][1].Size(); j++)
+				if(!postings[i][1][j].IsString())
+					return false;
+		}
+
+		for(size_t i=0; i<postings.Size(); i++)
+		{
+			set<string>& keys=index.postings[postings[i][0]];
+			const Data& L=postings[i][1];
+
+			for(size_t j=0; j<L.Size(); j++)
+			{
+				keys.insert(L[j].String());
+				index.entries[L[j].String()].insert(postings[i][0]);
+			}
+		}
+
+		index.saved=true;
+
+		return true;
+	}
+
+	void DataFileDB::SecondarySave(DBSecondaryIndex& index,const string& name) const
+	{
+		struct stat keys_stat;
+		if(stat((dir+"/keys").c_str(),&keys_stat)!=0)
+			throw Error::IO("DataFileDB::SecondarySave()","unable to access "+dir+"/keys");
+
+		Data postings;
+		postings.MakeList(index.postings.size());
+
+		map<Data,set<string> >::const_iterator i;
+		size_t n=0;
+		for(i=index.postings.begin(); i!=index.postings.end(); i++)
+		{
+			Data keys;
+			keys.MakeList(i->second.size());
+
+			size_t k=0;
+			for(set<string>::const_iterator j=i->second.begin(); j!=i->second.end(); j++)
+				keys[k++]=*j;
+
+			postings[n++]=Data(i->first,keys);
+		}
+
+		security.WriteFile(SecondaryFileName(name));
+		ostringstream content;
+		PrettySave(content,Data(index.Definition(),Data((int)keys_stat.st_size,(int)keys_stat.st_mtime,(int)FileChecksum(dir+"/keys")),postings));
+		WriteFile("index-"+name,content.str());
+
+		index.saved=true;
+	}
+
+	DBSecondaryIndex& DataFileDB::Secondary(const string& name) const
+	{
+		map<string,DBSecondaryIndex>::iterator i=secondary.find(name);
+		if(i==secondary.end())
+			throw LangErr("DataFileDB::Secondary(const string&)","no such index '"+name+"'");
+
+		return i->second;
+	}
+
+	void DataFileDB::CreateIndex(const string& name,const Data& path,int field,const string& op,const Data& value)
+	{
+		if(dbtype!=DBStringKeys)
+			throw LangErr("DataFileDB::CreateIndex(...)","indices are supported only for DBStringKeys");
+		if(name=="")
+			throw LangErr("DataFileDB::CreateIndex(...)","empty index name");
+		for(size_t i=0; i<name.length(); i++)
+			if(!isalnum(name[i]) && name[i]!='_' && name[i]!='-')
+				throw LangErr("DataFileDB::CreateIndex(...)","invalid index name '"+name+"'");
+		if(op!="" && op!="==" && op!="!=" && op!="<" && op!=">" && op!="<=" && op!=">=")
+			throw LangErr("DataFileDB::CreateIndex(...)","invalid operator '"+op+"'");
+		if(!path.IsList())
+			throw LangErr("DataFileDB::CreateIndex(...)","path must be a list");
+
+		DBSecondaryIndex index;
+		index.path=path;
+		index.field=field;
+		index.op=op;
+		index.value=value;
+
+		map<string,DBSecondaryIndex>::iterator old=secondary.find(name);
+		if(old!=secondary.end())
+		{
+			if(old->second.Definition()==index.Definition())
+				return;
+			secondary.erase(old);
+		}
+
+		SecondaryUpdate();
+
+		DBSecondaryIndex& idx=secondary[name];
+		idx=index;
+
+		if(SecondaryLoad(idx,name))
+		{
+			// Entries changed since the last save are not in the file.
+			for(size_t i=0; i<status.size(); i++)
+				if(status[i].dirty)
+					secondary_pending.insert(KeyString(i));
+
+			Dump("CreateIndex()","loaded index "+name);
+			return;
+		}
+
+		// Scan all entries and drop those from memory which were
+		// not there before.
+		for(size_t i=0; i<status.size(); i++)
+		{
+			bool was_ondisk=status[i].ondisk;
+			LoadCache(i);
+			SecondaryEntry(idx,KeyString(i),&vec[i][1]);
+			if(was_ondisk && !status[i].dirty && !status[i].pinned)
+			{
+				vec[i][1]=Null;
+				status[i].ondisk=true;
+			}
+		}
+
+		if(!IsDirty())
+			SecondarySave(idx,name);
+	}
+
+	void DataFileDB::DropIndex(const string& name)
+	{
+		Secondary(name);
+		unlink(SecondaryFileName(name).c_str());
+		secondary.erase(name);
+		if(secondary.empty())
+			secondary_pending.clear();
+	}
+
+	Data DataFileDB::IndexLookup(const string& name,const Data& value) const
+	{
+		DBSecondaryIndex& index=Secondary(name);
+		SecondaryUpdate();
+
+		Data ret;
+		map<Data,set<string> >::const_iterator i=index.postings.find(value);
+		if(i==index.postings.end())
+		{
+			ret.MakeList();
+			return ret;
+		}
+
+		ret.MakeList(i->second.size());
+		size_t n=0;
+		for(set<string>::const_iterator j=i->second.begin(); j!=i->second.end(); j++)
+			ret[n++]=*j;
+
+		return ret;
+	}
+
+	unsigned int DataFileDB::IndexRevision(const string& name,const Data& key) const
+	{
+		DBSecondaryIndex& index=Secondary(name);
+		SecondaryUpdate();
+
+		map<string,unsigned int>::const_iterator i=index.revision.find(key.String());
+
+		return i==index.revision.end() ? 0 : i->second;
+	}
+
+	unsigned int DataFileDB::EntryRevision(const Data& key) const
+	{
+		if(dbtype!=DBStringKeys && dbtype!=DBVector)
+			throw LangErr("DataFileDB::EntryRevision(const Data&)","entry revisions not supported for database type "+TypeToString(dbtype));
+
+		int index=EntryIndex(key);
+		if(index < 0)
+			return 0;
+		if(status[index].revision==0)
+			status[index].revision=++last_entry_revision;
+
+		return status[index].revision;
+	}
+
+	Data DataFileDB::IndexValues(const string& name,const Data& key) const
+	{
+		DBSecondaryIndex& index=Secondary(name);
+		SecondaryUpdate();
+
+		Data ret;
+		map<string,set<Data> >::const_iterator i=index.entries.find(key.String());
+		if(i==index.entries.end())
+		{
+			ret.MakeList();
+			return ret;
+		}
+
+		ret.MakeList(i->second.size());
+		size_t n=0;
+		for(set<Data>::const_iterator j=i->second.begin(); j!=i->second.end(); j++)
+			ret[n++]=*j;
+
+		return ret;
+	}
+
 	// Data access
 	// ===========
 
@@ -597,6 +1805,7 @@ namespace Evaluator
 			throw Error::Invalid("DataFileDB::operator=(const DataFileDB&)","cannot create copy of non-empty database");
 		
 		DestroyContent();
+		ReleaseIndex();
 		
 		dbtype=DBNone;
 		dir="";
@@ -609,6 +1818,7 @@ namespace Evaluator
 		Dump("operator=(const Data&)","copy from",z);
 		
 		DestroyContent();
+		ReleaseIndex();
 		
 		if(dbtype==DBNone)
 			throw Error::IO("DataFileDB::operator=(const Data&)","cannot assign to database type DBNone");
@@ -641,6 +1851,21 @@ namespace Evaluator
 			
 			return *this;
 		}
+		else if(dbtype==DBVector)
+		{
+			if(!z.IsList() && !z.IsNull())
+				throw LangErr("DataFileDB::operator=(const DataFileDB&)","only lists can be stored into DBVector");
+
+			MakeList(z.IsNull() ? 0 : z.Size());
+			status=vector<DBEntryStatus>((vec.size()+DB_PAGE_SIZE-1)/DB_PAGE_SIZE);
+
+			for(size_t i=0; i<vec.size(); i++)
+				vec[i]=z[i];
+
+			MarkAllDirty();
+
+			return *this;
+		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::operator=(const Data&)");
 	}
@@ -657,11 +1882,11 @@ namespace Evaluator
 			MarkDirty(i);
 			return Data::operator[](i);
 		}
-		else if(dbtype==DBStringKeys)
+		else if(dbtype==DBStringKeys || dbtype==DBVector)
 		{
 			MarkDirty(i);
-			LoadCache(i);
 			CacheUpdate();
+			LoadCache(StatusIndex(i));
 			return vec[i];
 		}
 		else
@@ -677,15 +1902,54 @@ namespace Evaluator
 			throw LangErr("DataFileDB::operator[](int)","cannot use [] on database type DBNone");
 		else if(dbtype==DBSingleFile)
 			return Data::operator[](i);
-		else if(dbtype==DBStringKeys)
+		else if(dbtype==DBStringKeys || dbtype==DBVector)
 		{
-			LoadCache(i);
+			LoadCache(StatusIndex(i));
 			return vec[i];
 		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::operator[](int)");
 	}
 
+	const Data& DataFileDB::operator[](const Data& key) const
+	{
+		if(dbtype!=DBStringKeys)
+			return Data::operator[](key);
+
+		bool found;
+		size_t pos=KeyLookup(key,found);
+
+		if(!found)
+			return Null;
+
+		LoadCache(pos);
+
+		return ((const cow_vector<Data>&)(vec))[pos][1];
+	}
+
+	Data DataFileDB::Peek(const Data& key) const
+	{
+		if(dbtype!=DBStringKeys)
+			return (*this)[key];
+
+		bool found;
+		size_t pos=KeyLookup(key,found);
+
+		if(!found)
+			return Null;
+
+		bool was_ondisk=status[pos].ondisk;
+		LoadCache(pos);
+		Data ret=((const cow_vector<Data>&)(vec))[pos][1];
+		if(was_ondisk && !status[pos].dirty && !status[pos].pinned)
+		{
+			vec[pos][1]=Null;
+			status[pos].ondisk=true;
+		}
+
+		return ret;
+	}
+
 	// Key lookup
 	// ==========
 	
@@ -704,13 +1968,15 @@ namespace Evaluator
 			if(!key.IsString())
 				throw LangErr("DataFileDB::KeyLookup(const Data&,bool&)","invalid key type "+type_of(key).String()+" for DBStringKeys");
 
-			size_t pos=Data::KeyLookup(key,already_exist);
+			size_t pos=FindPosition(key,already_exist);
 
 			if(already_exist)
 				Touch(pos);
 			
 			return pos;
 		}
+		else if(dbtype==DBVector)
+			throw LangErr("DataFileDB::KeyLookup(const Data&,bool&)","cannot do key lookup on database type DBVector");
 		else
 			throw Error::NotYetImplemented("DataFileDB::KeyLookup(const Data&,bool&)");
 			
@@ -730,6 +1996,8 @@ namespace Evaluator
 			bool is_old;
 			size_t pos;
 		
+			// Update the cache first, since it must not remove the entry returned.
+			CacheUpdate();
 			pos=KeyLookup(key,is_old);
 
 			if(is_old)
@@ -745,10 +2013,11 @@ namespace Evaluator
 
 			Touch(pos);
 			MarkDirty(pos);
-			CacheUpdate();
 			
 			return &vec[pos];
 		}
+		else if(dbtype==DBVector)
+			throw LangErr("DataFileDB::FindKey(const Data&)","cannot do key lookup on database type DBVector");
 		else
 			throw Error::NotYetImplemented("DataFileDB::FindKey(const Data&)");
 	}
@@ -765,23 +2034,71 @@ namespace Evaluator
 		}
 		else if(dbtype==DBStringKeys)
 		{
+			MaterializeAll();
+
 			Data *ret=Data::InsertAt(pos,object);
 			status.insert(status.begin()+pos,DBEntryStatus());
 			MarkDirty(pos);
 			
 			return ret;
 		}
+		else if(dbtype==DBVector)
+		{
+			if(pos < 0 || pos > (int)vec.size())
+				throw LangErr("DataFileDB::InsertAt(int pos,const Data&)","invalid position");
+
+			// Shift elements up one page at a time from the end, so
+			// that at most two pages are loaded for the shift.
+			vector<bool> resident=ResidentPages();
+			if(vec.size() == status.size()*DB_PAGE_SIZE)
+			{
+				status.push_back(DBEntryStatus());
+				resident.push_back(true);
+			}
+
+			int first=StatusIndex(pos);
+			int last=status.size()-1;
+			LoadCache(last);
+			vec.push_back(Null);
+
+			for(int p=last; p>=first; p--)
+			{
+				size_t begin=p*DB_PAGE_SIZE;
+				size_t end=::min(begin+DB_PAGE_SIZE,vec.size());
+				for(size_t k=end-1; k>begin && k>(size_t)pos; k--)
+					vec[k]=vec[k-1];
+				status[p].dirty=true;
+
+				if(p > first)
+				{
+					LoadCache(p-1);
+					vec[begin]=vec[begin-1];
+					ReleasePage(p,resident[p]);
+				}
+			}
+
+			vec[pos]=object;
+			CacheUpdate();
+
+			return &vec[pos];
+		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::InsertAt(int pos,const Data&)");
 	}
 
 	Data DataFileDB::Keys() const
 	{
+		if(dbtype==DBVector)
+			return Null;
+
 		Data ret;		
 		ret.MakeList(Size());
 		
 		for(size_t i=0; i<Size(); i++)
-			ret[i]=Data::operator[](i)[0];
+			if(dbtype==DBStringKeys)
+				ret[i]=KeyString(i);
+			else
+				ret[i]=Data::operator[](i)[0];
 
 		return ret;
 	}
@@ -790,6 +2107,17 @@ namespace Evaluator
 	{
 		if(dbtype==DBNone)
 			throw LangErr("DataFileDB::AddList(const Data&)","cannot add list entries to type DBNone");
+		else if(dbtype==DBVector)
+		{
+			if(vec.size() == status.size()*DB_PAGE_SIZE)
+				status.push_back(DBEntryStatus());
+			else
+				LoadCache(status.size()-1);
+
+			vec.push_back(item);
+			MarkDirty(vec.size()-1);
+			CacheUpdate();
+		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::AddList(const Data&)");
 	}
@@ -803,13 +2131,196 @@ namespace Evaluator
 			if(index < 0 || index >= (int)vec.size())
 				throw Error::Invalid("DataFileDB::DelList(int)","Index out of range");
 
-			unlink(FileName(vec[index][0].String()).c_str());
+			MaterializeAll();
+			string key=vec[index][0].String();
+			deleted_keys.insert(key);
 			
 			vec.erase(index);
 			status.erase(status.begin()+index);
-			SaveToDisk();
+			SecondaryChanged(key);
+		}
+		else if(dbtype==DBVector)
+		{
+			if(index < 0 || index >= (int)vec.size())
+				throw Error::Invalid("DataFileDB::DelList(int)","Index out of range");
+
+			// Shift elements down one page at a time.
+			vector<bool> resident=ResidentPages();
+			int first=StatusIndex(index);
+			int last=status.size()-1;
+			LoadCache(first);
+
+			for(int p=first; p<last; p++)
+			{
+				size_t begin=p*DB_PAGE_SIZE;
+				size_t end=begin+DB_PAGE_SIZE;
+				for(size_t k=::max(begin,(size_t)index); k+1<end; k++)
+					vec[k]=vec[k+1];
+
+				LoadCache(p+1);
+				vec[end-1]=vec[end];
+				status[p].dirty=true;
+				ReleasePage(p,resident[p]);
+			}
+
+			for(size_t k=::max(last*DB_PAGE_SIZE,index); k+1<vec.size(); k++)
+				vec[k]=vec[k+1];
+			vec.erase(vec.size()-1);
+
+			if(vec.size() == (status.size()-1)*DB_PAGE_SIZE)
+			{
+				Journal(status.size()-1);
+				unlink(EntryFileName(status.size()-1).c_str());
+				status.pop_back();
+			}
+			else
+			{
+				status[last].dirty=true;
+				ReleasePage(last,resident[last]);
+			}
+			CacheUpdate();
 		}
 		else
 			throw Error::NotYetImplemented("DataFileDB::DelList(int)");
 	}
+
+	size_t DataFileDB::DelEntries(const Data& keys)
+	{
+		if(!keys.IsList())
+			throw Error::Invalid("DataFileDB::DelEntries(const Data&)","Key list expected");
+
+		if(dbtype==DBNone)
+			throw LangErr("DataFileDB::DelEntries(const Data&)","cannot delete entries from type DBNone");
+		else if(dbtype==DBSingleFile)
+		{
+			size_t deleted=Data::DelEntries(keys);
+			if(deleted)
+				MarkAllDirty();
+
+			return deleted;
+		}
+		else if(dbtype==DBStringKeys)
+		{
+			// Collect positions of existing keys.
+			vector<bool> deleted(vec.size(),false);
+			size_t count=0;
+			bool found;
+
+			for(size_t i=0; i<keys.Size(); i++)
+			{
+				if(!keys[i].IsString())
+					continue;
+
+				size_t pos=KeyLookup(keys[i],found);
+				if(found && !deleted[pos])
+				{
+					deleted[pos]=true;
+					count++;
+				}
+			}
+			if(count==0)
+				return 0;
+
+			MaterializeAll();
+
+			// Compact entries and their status in one pass.
+			vector<Data>& V=vec.ref();
+			size_t n=0;
+			for(size_t i=0; i<V.size(); i++)
+			{
+				if(deleted[i])
+				{
+					string key=V[i][0].String();
+					deleted_keys.insert(key);
+					SecondaryChanged(key);
+					continue;
+				}
+				if(n!=i)
+				{
+					V[n]=V[i];
+					status[n]=status[i];
+				}
+				n++;
+			}
+			V.erase(V.begin()+n,V.end());
+			status.erase(status.begin()+n,status.end());
+
+			return count;
+		}
+		else if(dbtype==DBVector)
+		{
+			vector<Data> sorted;
+			for(size_t i=0; i<keys.Size(); i++)
+				sorted.push_back(keys[i]);
+			std::sort(sorted.begin(),sorted.end());
+
+			// Compact the vector reading one page at a time. Pages
+			// between the write position and the read position are
+			// not needed until written, so only two pages are loaded.
+			vector<bool> resident=ResidentPages();
+			size_t n=0,deleted=0;
+			int written=-1;
+
+			for(int p=0; p<(int)status.size(); p++)
+			{
+				LoadCache(p);
+
+				size_t end=::min((p+1)*DB_PAGE_SIZE,(int)vec.size());
+				for(size_t k=p*DB_PAGE_SIZE; k<end; k++)
+				{
+					if(IsDeleted(vec[k],sorted))
+					{
+						deleted++;
+						continue;
+					}
+
+					if(n!=k)
+					{
+						int target=StatusIndex(n);
+						if(target!=written)
+						{
+							if(written >= 0)
+								ReleasePage(written,resident[written]);
+							written=target;
+							LoadCache(written);
+						}
+						vec[n]=vec[k];
+						status[written].dirty=true;
+					}
+					n++;
+				}
+
+				if(p!=written)
+					ReleasePage(p,resident[p]);
+			}
+
+			if(deleted==0)
+				return 0;
+
+			// The last remaining page must be in memory when it shrinks.
+			int last=n ? StatusIndex(n-1) : -1;
+			if(last >= 0)
+			{
+				LoadCache(last);
+				status[last].dirty=true;
+			}
+
+			vector<Data>& V=vec.ref();
+			V.erase(V.begin()+n,V.end());
+
+			while(status.size() && vec.size() <= (status.size()-1)*DB_PAGE_SIZE)
+			{
+				Journal(status.size()-1);
+				unlink(EntryFileName(status.size()-1).c_str());
+				status.pop_back();
+			}
+			if(last >= 0)
+				ReleasePage(last,resident[last]);
+			CacheUpdate();
+
+			return deleted;
+		}
+		else
+			throw Error::NotYetImplemented("DataFileDB::DelEntries(const Data&)");
+	}
 }
@@ -32,6 +32,10 @@ using namespace std;
 /// Namespace for card database and inquiry functions.
 namespace Database
 {
+	struct SnapshotCard;
+	struct SnapshotPair;
+	struct SnapshotName;
+
 	/// Storage for card information.
 	class CardSet
 	{
@@ -59,9 +63,36 @@ namespace Database
 		map<string,int> last_card;
 		/// Next free card id.
 		int nextcard;
+		/// Card set files loaded in order.
+		list<string> source;
+
+		/// Memory mapped snapshot or 0 if cards are loaded from XML.
+		char* snapshot;
+		/// Size of the snapshot in bytes.
+		size_t snapshot_size;
+		/// Card records of the snapshot.
+		const SnapshotCard* snapshot_card;
+		/// Attribute (key,value) pairs referred by card records.
+		const SnapshotPair* snapshot_pair;
+		/// Card names sorted by name and card number.
+		const SnapshotName* snapshot_name;
+		/// Number of entries in name index.
+		size_t snapshot_names;
+		/// String table of the snapshot.
+		const char* snapshot_string;
+		/// Size of the string table in bytes.
+		size_t snapshot_strings;
 
 		/// Add card set: copy 'name' attribute to each image and establish name lookup tables.
 		void Validate(XML::Document& D);
+		/// Return value of attribute 'key' of the card element or empty string if not set.
+		string Property(int cardnumber,const string& key) const;
+		/// Return a string of the snapshot string table.
+		string SnapshotString(unsigned offset) const;
+		/// Return all card numbers of cards having exactly the name s.
+		list<int> Numbers(const string& s);
+		/// Release the snapshot.
+		void CloseSnapshot();
 
 		/// Protect copying. It's unusable without proper handler.
 		CardSet(const CardSet&)
@@ -74,8 +105,19 @@ namespace Database
 
 		/// Create an empty data base.
 		CardSet();
+		/// Release the snapshot if any.
+		~CardSet();
 		/// Add cards of the XML file. Copy 'set' attribute to every image loaded from the set 'name'.
 		void AddCards(const string& filename);
+		/// Map cards read-only from a snapshot file. Fail and return false
+		/// unless the snapshot was made from exactly the given card set files
+		/// and none of them has changed since.
+		bool LoadSnapshot(const string& filename,const list<string>& files);
+		/// Write cards loaded from XML files to a snapshot file.
+		void SaveSnapshot(const string& filename) const;
+		/// Return true if cards are mapped from a snapshot.
+		bool Snapshot() const
+			{return snapshot!=0;}
 		/// How many cards.
 		int Cards() const
 			{return nextcard;}
@@ -134,7 +176,7 @@ namespace Database
 		int SetSize(const string& set_abbrev)
 			{return last_card[set_abbrev]-first_card[set_abbrev]+1;}
 
-		/// Reference to XML document.
+		/// Reference to XML document. Empty if cards are mapped from a snapshot.
 		const XML::Document& XML() const
 			{return db;}
 	};
@@ -0,0 +1,36 @@
+/*
+    Gccg - Generic collectible card game.
+    Copyright (C) 2001,2002,2003,2004 Tommi Ronkainen
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program, in the file license.txt. If not, write
+  to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+  Boston, MA 02111-1307, USA.
+*/
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <string>
+
+using namespace std;
+
+/// Compress 'size' bytes from 'src' and append the result to 'out'. The
+/// method is a byte oriented LZ77 variant, which favours speed over
+/// compression ratio. Data does not always shrink.
+void LZCompress(const char* src,size_t size,string& out);
+/// Decompress data produced by LZCompress() and append it to 'out'.
+/// Throw Error::Invalid if the data is corrupted or the result would
+/// be longer than 'max_size' bytes.
+void LZDecompress(const char* src,size_t size,string& out,size_t max_size);
+
+#endif
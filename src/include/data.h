@@ -194,6 +194,8 @@ namespace Evaluator
 		virtual Data Keys() const;
 		/// Delete an dictionary entry. Return 1 if found.
 		virtual bool DelEntry(const Data& d);
+		/// Delete all members whose key (first component of a pair, otherwise the member itself) is in the list 'keys'. Return the number of members deleted.
+		virtual size_t DelEntries(const Data& keys);
 		
 		/// True if object is NULL.
 		bool IsNull() const
@@ -213,6 +215,9 @@ namespace Evaluator
 		/// True if object is a real number.
 		bool IsReal() const
 			{return type==RealType;}
+		/// True if both objects are lists sharing the same members, i.e. copies of the same list not changed since.
+		bool Shares(const Data& z) const
+			{return type==ListType && z.type==ListType && &vec.const_ref()==&z.vec.const_ref();}
 
 		/// Return integer value of the object or zero if the object is not an integer.
 		int Integer() const
@@ -253,6 +258,8 @@ namespace Evaluator
 
 	/// Dump value of the object D.
 	ostream& operator<<(ostream& O,const Data& D);
+	/// Return true if the key of a list member (first component of a pair, otherwise the member itself) is found from the sorted list of keys.
+	bool IsDeleted(const Data& member,const vector<Data>& keys);
 
 }
 
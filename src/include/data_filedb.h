@@ -33,7 +33,7 @@ namespace Evaluator
 {
 	enum FileDBType
 	{
-		DBNone,DBSingleFile,DBStringKeys
+		DBNone,DBSingleFile,DBStringKeys,DBVector
 	};
 
 	struct DBEntryStatus
@@ -44,21 +44,73 @@ namespace Evaluator
 		time_t access;
 		/// True if entry is stored on disk, not in memory.
 		bool ondisk;
+		/// Number of pins holding the entry in memory.
+		int pinned;
+		/// Size of the entry on disk in bytes.
+		size_t size;
+		/// Checksum of the entry on disk or 0 if not known.
+		unsigned int checksum;
+		/// Number given to the entry when it was last marked dirty or 0 if not yet given.
+		unsigned int revision;
 
 		DBEntryStatus()
-			{dirty=false; ::time(&access); ondisk=false;}
+			{dirty=false; ::time(&access); ondisk=false; pinned=0; size=0; checksum=0; revision=0;}
 	};
 	
+	/// Secondary index mapping keys of a dictionary found inside
+	/// each entry of DBStringKeys database to the keys of those entries.
+	struct DBSecondaryIndex
+	{
+		/// List of list indices and dictionary keys leading from the entry value to the indexed dictionary.
+		Data path;
+		/// Member of the dictionary value compared to 'value' or -1 to compare the whole value.
+		int field;
+		/// Comparison operator "==", "!=", "<", ">", "<=", ">=" or "" to accept all.
+		string op;
+		/// Value compared to the dictionary values.
+		Data value;
+		/// Keys of entries for each indexed dictionary key.
+		map<Data,set<string> > postings;
+		/// Indexed dictionary keys for each entry key.
+		map<string,set<Data> > entries;
+		/// Number of times the indexed keys of each entry have changed.
+		map<string,unsigned int> revision;
+		/// True if the index file is up to date.
+		bool saved;
+
+		DBSecondaryIndex()
+			{field=-1; saved=false;}
+		/// Return the definition of the index as a list (path,field,op,value).
+		Data Definition() const
+			{return Data(path,field,op,value);}
+	};
+
 	class DataFileDB : public Data
 	{		
 		/// Type of the database.
 		FileDBType dbtype;
 		/// Full pathname of the database directory.
 		string dir;
-		/// Status of each vector database entry.
+		/// Status of each vector database entry or each page of DBVector.
 		mutable vector<DBEntryStatus> status;
 		/// Status of single value database.
 		DBEntryStatus single_status;
+		/// Content of the key index file while keys are read from it, otherwise NULL.
+		const char* index_data;
+		/// Length of the key index file content.
+		size_t index_length;
+		/// Secondary indices by name.
+		mutable map<string,DBSecondaryIndex> secondary;
+		/// Keys of the entries changed after the secondary indices were updated.
+		mutable set<string> secondary_pending;
+		/// Names of the entry files recorded in the journal since the last complete save.
+		mutable set<string> journaled;
+		/// Keys of deleted entries whose files are removed after the keys are saved.
+		set<string> deleted_keys;
+		/// True while saving, when directories are synced once at the end.
+		mutable bool sync_later;
+		/// Directories having renamed files not yet synced.
+		mutable set<string> unsynced;
 
 		void Dump(const string& function,const string& description,const Data& data) const;
 		void Dump(const string& function,const string& description) const
@@ -68,8 +120,16 @@ namespace Evaluator
 		
 		/// Read content of the file in the database directory and return it's contents.
 		string ReadFile(const string& filename) const;
-		/// Write a string s to the file in the database directory.
+		/// Write a string s to the file in the database directory replacing the old file atomically.
 		void WriteFile(const string& filename,const string& s) const;
+		/// Record an entry file to the journal before it is changed on the disk.
+		void Journal(int index) const;
+		/// Make renames in the directory durable now or at the end of the save.
+		void SyncDir(const string& path) const;
+		/// Sync all directories having renames not yet synced.
+		void SyncDirs() const;
+		/// Repair the entries recorded in the journal after an unclean shutdown.
+		void Recover();
 		
 		/// Return type of database if the database exist in the disk.
 		FileDBType DatabaseExist() const;
@@ -82,6 +142,13 @@ namespace Evaluator
 		void MarkAllClean();
 		/// Mark one vector entry ss dirty.
 		void MarkDirty(int index);
+		/// Return the index of the status entry covering the vector element.
+		int StatusIndex(int element) const
+			{return dbtype==DBVector ? element/DB_PAGE_SIZE : element;}
+		/// Return flags telling which pages of DBVector are currently in memory.
+		vector<bool> ResidentPages() const;
+		/// Move a page of DBVector back to the disk after shifting elements unless it was in memory before.
+		void ReleasePage(int page,bool resident);
 		
 		/// Initialize empty file structures to hold database.
 		void CreateEmpty();
@@ -92,16 +159,57 @@ namespace Evaluator
 		/// Remove all disk files associated to the database.
 		void DestroyContent();
 
+		/// Initialize entries from the key index file. Return false if the index is missing or out of date.
+		bool LoadIndex();
+		/// Write the key index file describing current entries.
+		void SaveIndex() const;
+		/// Stop reading keys from the key index file.
+		void ReleaseIndex();
+		/// Return the key of a vector element without creating the element in memory.
+		string KeyString(int index) const;
+		/// Create a vector element in memory if it's key is still only in the index file.
+		void Materialize(int index) const;
+		/// Create all vector elements in memory and stop using the index file.
+		void MaterializeAll();
+		/// Return position of the key in the sorted key vector and whether or not key was found.
+		size_t FindPosition(const Data& key,bool& found) const;
+
+		/// Return the name of the file storing a secondary index.
+		string SecondaryFileName(const string& name) const
+			{return dir+"/index-"+name;}
+		/// Queue an entry to be updated in the secondary indices and invalidate index files.
+		void SecondaryChanged(const string& key) const;
+		/// Replace the indexed keys of one entry having the given value or no value if NULL.
+		void SecondaryEntry(DBSecondaryIndex& index,const string& key,const Data* value) const;
+		/// Update the secondary indices for a queued entry.
+		void SecondaryUpdate(const string& key) const;
+		/// Update the secondary indices for all queued entries.
+		void SecondaryUpdate() const;
+		/// Read a secondary index from the disk. Return false if it is missing or out of date.
+		bool SecondaryLoad(DBSecondaryIndex& index,const string& name);
+		/// Write a secondary index to the disk.
+		void SecondarySave(DBSecondaryIndex& index,const string& name) const;
+		/// Return a secondary index or throw an error if it does not exist.
+		DBSecondaryIndex& Secondary(const string& name) const;
+
 		/// Update last access time.
 		void Touch(int index) const;
 		/// Convert a string to the cache entry filename.
 		string FileName(const string& entry) const;
+		/// Return the filename of the cache entry having the given status index.
+		string EntryFileName(int index) const;
 		/// Load vector element from disk if not already loaded.
 		void LoadCache(int index) const;
 		/// Save vector element to the disk and remove from memory if
 		/// not already removed. Return 1, if the element was written to the disk.
 		bool SaveCache(int index) const;
-                /// Return the index of the oldest entry or -1 if empty.
+		/// Write vector element to the disk keeping it in memory.
+		void WriteCache(int index) const;
+		/// Ask the operating system to start reading vector element from the disk.
+		void ReadAhead(int index) const;
+		/// Return the status index of an existing entry with the given key or -1 if not found.
+		int EntryIndex(const Data& key) const;
+                /// Return the index of the oldest unpinned entry in memory or -1 if none.
 		int Oldest() const;
 		/// Check if enough time has passed since the last update. Search
 		/// old entries and store them to the disk.
@@ -121,6 +229,9 @@ namespace Evaluator
 		/// Maximum number of entries in RAM.
 		int CACHE_MAX_RESIDENT;
 
+		/// Number of vector elements stored in a single page of DBVector.
+		static const int DB_PAGE_SIZE=256;
+
 		static const time_t MINUTE=60;
 		static const time_t HOUR=60*MINUTE;
 		static const time_t DAY=24*HOUR;
@@ -132,8 +243,8 @@ namespace Evaluator
 
 		virtual ~DataFileDB();
 
-		/// Associate 'variable' with database and initialize it to the value 'init' if database does not exist already.
-		void Attach(const Data& init, const string& variablename,FileDBType type);
+		/// Associate 'variable' with database in the directory 'directory' and initialize it to the value 'init' if database does not exist already.
+		void Attach(const Data& init, const string& directory, const string& variablename,FileDBType type);
 		/// Replace the whole database changing it's type.
 		DataFileDB& operator=(const DataFileDB& z);
 		/// Set the current value for database.
@@ -142,6 +253,11 @@ namespace Evaluator
 		virtual Data& operator[](int i);
 		/// Indexed access to vectors.
 		virtual const Data& operator[](int i) const;
+		/// Return a value of a dictionary entry or Null if not found.
+		virtual const Data& operator[](const Data& key) const;
+		/// Return a copy of a dictionary entry value or Null if not
+		/// found. An entry read from the disk is not kept in memory.
+		Data Peek(const Data& key) const;
 
 		virtual bool IsDatabase() const
 			{return 1;}
@@ -156,12 +272,38 @@ namespace Evaluator
 		virtual Data Keys() const;
 		/// Add an object to the list.
 		virtual void AddList(const Data& item);
-		/// Delete an object from the list.
+		/// Delete an object from the list. Keys are saved by the next save.
 		virtual void DelList(int index);
+		/// Delete all entries with the given keys. Keys are saved by the next save.
+		virtual size_t DelEntries(const Data& keys);
 
 		/// Save all data to the disk.
 		void SaveToDisk();
 
+		/// Load entries with the given keys to memory. Return the number of entries read from the disk.
+		int Prefetch(const Data& keys);
+		/// Load entries with the given keys to memory and keep them there until unpinned. Return the number of entries pinned.
+		int Pin(const Data& keys);
+		/// Release one pin of each entry with the given keys. Return the number of entries unpinned.
+		int Unpin(const Data& keys);
+
+		/// Create a secondary index over the dictionary found at 'path'
+		/// inside each entry value. Dictionary keys whose value (or it's
+		/// member 'field') satisfies 'op value' are indexed. The index is
+		/// read from the disk if it has been saved with the same definition.
+		void CreateIndex(const string& name,const Data& path,int field,const string& op,const Data& value);
+		/// Remove a secondary index.
+		void DropIndex(const string& name);
+		/// Return a sorted list of entry keys having the dictionary key 'value' in the index.
+		Data IndexLookup(const string& name,const Data& value) const;
+		/// Return a sorted list of dictionary keys indexed for the entry 'key'.
+		Data IndexValues(const string& name,const Data& key) const;
+		/// Return a number changing whenever the dictionary keys indexed for the entry 'key' change.
+		unsigned int IndexRevision(const string& name,const Data& key) const;
+		/// Return a non-zero number changing whenever the entry 'key' is
+		/// accessed for writing or 0 if there is no such entry.
+		unsigned int EntryRevision(const Data& key) const;
+
 		/// Convert a string to the database type.
 		static FileDBType StringToType(const string& s);
 		/// Convert a database type to the string.
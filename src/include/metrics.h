@@ -0,0 +1,128 @@
+/*
+    Gccg - Generic collectible card game.
+    Copyright (C) 2001,2002,2003,2004 Tommi Ronkainen
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program, in the file license.txt. If not, write
+  to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+  Boston, MA 02111-1307, USA.
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+#include <string>
+#include <map>
+#include "data.h"
+
+using namespace std;
+
+/// Number of latency histogram buckets.
+#define METRICS_BUCKETS 16
+
+namespace Evaluator
+{
+	/// Latency histogram with logarithmic buckets.
+	struct MetricsHistogram
+	{
+		/// Number of samples.
+		long count;
+		/// Sum of samples in seconds.
+		double total;
+		/// Largest sample in seconds.
+		double max;
+		/// Number of samples in each bucket.
+		long bucket[METRICS_BUCKETS];
+
+		MetricsHistogram();
+
+		/// Add a sample.
+		void Add(double seconds);
+		/// Return an upper bound in seconds for the given fraction of samples.
+		double Percentile(double fraction) const;
+	};
+
+	/// Current and largest value of a gauge.
+	struct MetricsGauge
+	{
+		double value;
+		double max;
+
+		MetricsGauge()
+			{value=0.0; max=0.0;}
+	};
+
+	/// Registry of named counters, gauges and latency histograms. Nothing is
+	/// recorded until the registry is enabled.
+	class Metrics
+	{
+		/// Set if recording is enabled.
+		bool enabled;
+
+		map<string,double> counter;
+		map<string,MetricsGauge> gauge;
+		map<string,MetricsHistogram> histogram;
+
+		/// Name of the periodic dump file or "" if not dumping.
+		string dump_file;
+		/// Seconds between dumps.
+		int dump_interval;
+		/// Time of the last dump.
+		time_t dump_time;
+
+	  public:
+
+		Metrics();
+
+		/// Start recording.
+		void Enable()
+			{enabled=true;}
+		/// Stop recording.
+		void Disable()
+			{enabled=false;}
+		/// Return true if recording is enabled.
+		bool Enabled() const
+			{return enabled;}
+
+		/// Return the current time in seconds.
+		static double Now();
+
+		/// Add 'n' to a counter.
+		void Count(const string& name,double n=1.0)
+			{if(enabled) counter[name]+=n;}
+		/// Set the value of a gauge.
+		void Gauge(const string& name,double value);
+		/// Add 'delta' to the value of a gauge.
+		void AddGauge(const string& name,double delta);
+		/// Record a duration in seconds to a histogram.
+		void Time(const string& name,double seconds)
+			{if(enabled) histogram[name].Add(seconds);}
+
+		/// Clear all values.
+		void Reset();
+		/// Return all values as a dictionary.
+		Data Values() const;
+
+		/// Write values to 'file' every 'interval' seconds. Empty file name stops dumping.
+		void SetDump(const string& file,int interval);
+		/// Write the dump file if it is due.
+		void Tick();
+		/// Write all values in readable form to a file.
+		void Dump(const string& file) const;
+	};
+
+	/// Shared metrics registry.
+	extern Metrics metrics;
+}
+
+#endif
@@ -46,6 +46,7 @@
 #include "version.h"
 #include "data_filedb.h"
 #include "parser_functions.h"
+#include "metrics.h"
 #ifdef PERFORMANCE_ANALYSIS
 #include <sys/time.h>
 #endif
@@ -174,6 +175,8 @@ namespace Evaluator
 	    int dump_indent;
 	    /// Pointer to the object which uses this parser.
 	    Application* user;
+	    /// Directory of the saved variables or empty to use the global save directory.
+	    string save_directory;
 #ifdef USE_SQUIRREL
     
         /// Squirrel VM instance.
@@ -229,6 +232,18 @@ namespace Evaluator
 	    Data operator()(const string& expr);
 	    /// Get reference to variable.
 	    Data& Variable(const string& var);
+	    /// Return the database attached to the variable or NULL if not attached.
+	    DataFileDB* Database(const string& var)
+		{
+		    map<string,DataFileDB>::iterator i=database.find(var);
+		    return i==database.end() ? 0 : &i->second;
+		}
+	    /// Return the directory where variables are saved and attached.
+	    string SaveDir() const
+		{return save_directory.size() ? save_directory : savedir;}
+	    /// Use the directory for saved and attached variables instead of the global save directory.
+	    void SetSaveDir(const string& dir)
+		{save_directory=dir;}
 	    /// Set variable value.
 	    void SetVariable(const string& var,const Data& val);
 	    /// Unset variable value.
@@ -261,19 +276,27 @@ namespace Evaluator
 	    Data binary_save(const Data& arg); 
 	    Data cache_parameters(const Data& arg); 
 	    Data cache_size(const Data& arg); 
+	    Data create_index(const Data& arg); 
 	    Data del_entry(const Data& arg); 
+	    Data del_entries(const Data& arg); 
 	    Data delsaved(const Data& arg); 
+	    Data drop_index(const Data& arg); 
 	    Data execute(const Data& arg); 
 	    Data forall(const Data& arg); 
+	    Data index_lookup(const Data& arg); 
+	    Data index_values(const Data& arg); 
 	    Data isfunction(const Data& arg); 
 	    Data isvar(const Data& arg); 
 	    Data keys(const Data& arg); 
 	    Data load(const Data& arg); 
+	    Data pin(const Data& arg); 
 	    Data pop(const Data& arg); 
+	    Data prefetch(const Data& arg); 
 	    Data push(const Data& arg); 
 	    Data repeat(const Data& arg); 
 	    Data save(const Data& arg); 
 	    Data select(const Data& arg); 
+	    Data unpin(const Data& arg); 
 	    Data valueof(const Data& arg); 
 	    Data sort_fn(const Data& arg); 
 #ifdef USE_SQUIRREL
@@ -586,7 +609,14 @@ namespace Evaluator
 			string old;
 			PerfCall(name,old);
 #endif
-			ret=(user->*(function[name]))(ret);
+			if(metrics.Enabled())
+			{
+			    double start=Metrics::Now();
+			    ret=(user->*(function[name]))(ret);
+			    metrics.Time("function."+name,Metrics::Now()-start);
+			}
+			else
+			    ret=(user->*(function[name]))(ret);
 #ifdef PERFORMANCE_ANALYSIS
 			PerfReturn(old);
 #endif
@@ -1605,16 +1635,19 @@ namespace Evaluator
 	    if(!IsVariable(s))
 		throw LangErr("save","invalid variable '"+s+"'");
 
+	    double start=Metrics::Now();
+
 	    if(database.find(s) != database.end())
 	    {
 		database[s].SaveToDisk();
+		metrics.Time("save."+s,Metrics::Now()-start);
 		return 1;
 	    }
 		
 	    if(variable.find(s) == variable.end())
 		throw LangErr("save","variable "+s+" not defined");
 		
-	    string f=savedir+"/"+s;
+	    string f=SaveDir()+"/"+s;
 
 	    security.WriteFile(f);
 		
@@ -1627,6 +1660,7 @@ namespace Evaluator
 	    PrettySave(F,variable[s]);
 #endif /* PRETTY_SAVE */
 	    F.close();
+	    metrics.Time("save."+s,Metrics::Now()-start);
 
 	    return 1;
 	}
@@ -1641,9 +1675,9 @@ namespace Evaluator
 	    string s=arg.String();
 	    if(s=="")
 		throw LangErr("load","empty variable name");
-	    string f=savedir+"/"+s;
+	    string f=SaveDir()+"/"+s;
 	    security.WriteFile(f);
-	    security.WriteFile(savedir+"/");
+	    security.WriteFile(SaveDir()+"/");
 
 	    return (int)(unlink(f.c_str())==0);
 	}
@@ -1658,7 +1692,7 @@ namespace Evaluator
 	    string s=arg.String();
 	    if(s=="")
 		throw LangErr("load","empty variable name");
-	    string f=savedir+"/"+s;
+	    string f=SaveDir()+"/"+s;
 
 	    security.ReadFile(f);
 
@@ -1729,7 +1763,8 @@ namespace Evaluator
     /// attach(v,t) - Attach a variable 'v' to the disk database. If the
     /// database does not exist yet, then current value of the
     /// variable 'v' is taken as initial content for the database having type t.
-    /// Supportet types are now "DBSingleFile" and "DBStringKeys". After
+    /// Supportet types are now "DBSingleFile", "DBStringKeys" and "DBVector"
+    /// (a list stored in pages of 256 elements loaded on demand). After
     /// that, each change in the value of variable 'v' is stored to
     /// the disk automatically. If the database exist already, then
     /// old value of the variable 'v' is ignored and the database is
@@ -1758,7 +1793,7 @@ namespace Evaluator
 	    }
 
 	    database.insert(pair<string,DataFileDB>(var,DataFileDB()));
-	    database[var].Attach(init,var,type);
+	    database[var].Attach(init,SaveDir(),var,type);
 		
 	    return Null;
 	}
@@ -1773,7 +1808,7 @@ namespace Evaluator
 	    string s=arg.String();
 	    if(s=="")
 		throw LangErr("binary_load","empty variable name");
-	    string f=savedir+"/"+s;
+	    string f=SaveDir()+"/"+s;
 
 	    security.ReadFile(f);
 
@@ -1820,7 +1855,7 @@ namespace Evaluator
 	    if(variable.find(s) == variable.end())
 		throw LangErr("binary_save","variable "+s+" not defined");
 		
-	    string f=savedir+"/"+s;
+	    string f=SaveDir()+"/"+s;
 	    security.WriteFile(f);
 		
 		ofstream F(f.c_str(), ios::out | ios::binary);
@@ -1906,6 +1941,39 @@ namespace Evaluator
 	    return Null;
 	}
 
+    /// del_entries(K,L) - Delete in one pass all members of $L$ whose key
+    /// is in the list $K$. The key of a pair is it's first component and
+    /// the key of any other member is the member itself. If $L$ is a list,
+    /// return the result. If $L$ is a string, delete entries directly from
+    /// the parser variable and return the number of entries deleted.
+    template <class Application> Data Parser<Application>::del_entries(const Data& arg)
+	{
+	    if(!arg.IsList(2) || !arg[0].IsList())
+		ArgumentError("del_entries",arg);
+
+	    if(arg[1].IsList())
+	    {
+		Data ret=arg[1];
+
+		ret.DelEntries(arg[0]);
+
+		return ret;
+	    }
+	    else if(arg[1].IsString())
+	    {
+		Data& var=Variable(arg[1].String());
+
+		if(!var.IsList())
+		    throw LangErr("del_entries","not a list");
+			
+		return (int)var.DelEntries(arg[0]);
+	    }
+	    else
+		ArgumentError("del_entries",arg);
+
+	    return Null;
+	}
+
     /// cache_parameters(var,(p1,p2,p3,p4)) - If only a variable name is
     ///   given, return the list containing current cache parameters
     ///   for that database variable.
@@ -1976,6 +2044,140 @@ namespace Evaluator
 	    return database[var].Loaded();
 	}
 
+    /// prefetch(var,keys) - Load entries of the database var having
+    ///   the given key or list of keys into memory. Disk reads for
+    ///   all entries are started before any of them is waited for.
+    ///   Return the number of entries read from the disk.
+    template <class Application> Data Parser<Application>::prefetch(const Data& arg)
+	{
+	    if(!arg.IsList(2) || !arg[0].IsString())
+		ArgumentError("prefetch",arg);
+
+	    string var=arg[0].String();
+
+	    if(database.find(var)==database.end())
+		throw LangErr("prefetch","no such database as "+var);
+
+	    return database[var].Prefetch(arg[1]);
+	}
+
+    /// pin(var,keys) - Load entries of the database var having the
+    ///   given key or list of keys into memory and keep them there
+    ///   until released by unpin(). Pins are counted, so each pin()
+    ///   needs a matching unpin(). Return the number of entries pinned.
+    template <class Application> Data Parser<Application>::pin(const Data& arg)
+	{
+	    if(!arg.IsList(2) || !arg[0].IsString())
+		ArgumentError("pin",arg);
+
+	    string var=arg[0].String();
+
+	    if(database.find(var)==database.end())
+		throw LangErr("pin","no such database as "+var);
+
+	    return database[var].Pin(arg[1]);
+	}
+
+    /// unpin(var,keys) - Release one pin set by pin() from each entry
+    ///   of the database var having the given key or list of
+    ///   keys. Return the number of entries unpinned.
+    template <class Application> Data Parser<Application>::unpin(const Data& arg)
+	{
+	    if(!arg.IsList(2) || !arg[0].IsString())
+		ArgumentError("unpin",arg);
+
+	    string var=arg[0].String();
+
+	    if(database.find(var)==database.end())
+		throw LangErr("unpin","no such database as "+var);
+
+	    return database[var].Unpin(arg[1]);
+	}
+
+    /// create_index(var,name,path) or create_index(var,name,path,field,op,value) -
+    ///   Create a secondary index 'name' for the DBStringKeys database
+    ///   var. The path is a list of list indices and dictionary keys
+    ///   leading from each entry value to a dictionary. Keys of that
+    ///   dictionary are indexed, if all of them are accepted or if the
+    ///   member 'field' of the dictionary value (whole value if -1)
+    ///   satisfies the comparison 'op value', where op is one of
+    ///   "==", "!=", "<", ">", "<=" or ">=". The index is kept up to
+    ///   date automatically and saved next to the database.
+    ///   For example create_index("users","forsale",(2,),1,">",0).
+    template <class Application> Data Parser<Application>::create_index(const Data& arg)
+	{
+	    int field=-1;
+	    string op;
+	    Data value;
+
+	    if(arg.IsList(6) && arg[3].IsInteger() && arg[4].IsString())
+	    {
+		field=arg[3].Integer();
+		op=arg[4].String();
+		value=arg[5];
+	    }
+	    else if(!arg.IsList(3))
+		ArgumentError("create_index",arg);
+	    if(!arg[0].IsString() || !arg[1].IsString() || !arg[2].IsList())
+		ArgumentError("create_index",arg);
+
+	    string var=arg[0].String();
+
+	    if(database.find(var)==database.end())
+		throw LangErr("create_index","no such database as "+var);
+
+	    database[var].CreateIndex(arg[1].String(),arg[2],field,op,value);
+
+	    return Null;
+	}
+
+    /// drop_index(var,name) - Remove a secondary index from the database var.
+    template <class Application> Data Parser<Application>::drop_index(const Data& arg)
+	{
+	    if(!arg.IsList(2) || !arg[0].IsString() || !arg[1].IsString())
+		ArgumentError("drop_index",arg);
+
+	    string var=arg[0].String();
+
+	    if(database.find(var)==database.end())
+		throw LangErr("drop_index","no such database as "+var);
+
+	    database[var].DropIndex(arg[1].String());
+
+	    return Null;
+	}
+
+    /// index_lookup(var,name,x) - Return a sorted list of keys of the
+    ///   database var entries having the dictionary key x in the index 'name'.
+    template <class Application> Data Parser<Application>::index_lookup(const Data& arg)
+	{
+	    if(!arg.IsList(3) || !arg[0].IsString() || !arg[1].IsString())
+		ArgumentError("index_lookup",arg);
+
+	    string var=arg[0].String();
+
+	    if(database.find(var)==database.end())
+		throw LangErr("index_lookup","no such database as "+var);
+
+	    return database[var].IndexLookup(arg[1].String(),arg[2]);
+	}
+
+    /// index_values(var,name,key) - Return a sorted list of
+    ///   dictionary keys in the index 'name' for the entry 'key' of
+    ///   the database var.
+    template <class Application> Data Parser<Application>::index_values(const Data& arg)
+	{
+	    if(!arg.IsList(3) || !arg[0].IsString() || !arg[1].IsString() || !arg[2].IsString())
+		ArgumentError("index_values",arg);
+
+	    string var=arg[0].String();
+
+	    if(database.find(var)==database.end())
+		throw LangErr("index_values","no such database as "+var);
+
+	    return database[var].IndexValues(arg[1].String(),arg[2]);
+	}
+
     /// sort_fn(f,L) - Return the list L sorted using the function f as comparison function.
     /// Each list member is substituted in place of '#' in the string
     /// f and evaluated to produce coparison function value.
@@ -2086,15 +2288,22 @@ namespace Evaluator
 	    internal_function["cache_parameters"]=&Parser<Application>::cache_parameters;
 	    internal_function["cache_size"]=&Parser<Application>::cache_size;
 	    internal_function["call"]=&Parser<Application>::call;
+	    internal_function["create_index"]=&Parser<Application>::create_index;
+	    internal_function["del_entries"]=&Parser<Application>::del_entries;
 	    internal_function["del_entry"]=&Parser<Application>::del_entry;
 	    internal_function["delsaved"]=&Parser<Application>::delsaved;
+	    internal_function["drop_index"]=&Parser<Application>::drop_index;
 	    internal_function["execute"]=&Parser<Application>::execute;
 	    internal_function["forall"]=&Parser<Application>::forall; 
+	    internal_function["index_lookup"]=&Parser<Application>::index_lookup;
+	    internal_function["index_values"]=&Parser<Application>::index_values;
 	    internal_function["isfunction"]=&Parser<Application>::isfunction;
 	    internal_function["isvar"]=&Parser<Application>::isvar;
 	    internal_function["keys"]=&Parser<Application>::keys;
 	    internal_function["load"]=&Parser<Application>::load;
+	    internal_function["pin"]=&Parser<Application>::pin;
 	    internal_function["pop"]=&Parser<Application>::pop; 
+	    internal_function["prefetch"]=&Parser<Application>::prefetch;
 	    internal_function["push"]=&Parser<Application>::push; 
 	    internal_function["repeat"]=&Parser<Application>::repeat; 
 	    internal_function["return"]=&Parser<Application>::_return; 
@@ -2102,6 +2311,7 @@ namespace Evaluator
 	    internal_function["select"]=&Parser<Application>::select;
 	    internal_function["sort_fn"]=&Parser<Application>::sort_fn;
 	    internal_function["stacktrace"]=&Parser<Application>::stacktrace;
+	    internal_function["unpin"]=&Parser<Application>::unpin;
 	    internal_function["valueof"]=&Parser<Application>::valueof;
 	    internal_function["vardump"]=&Parser<Application>::vardump;
 #ifdef USE_SQUIRREL
@@ -50,6 +50,7 @@ namespace Evaluator
 	// Standard library.
 	Data ReadLiteral(const char*& src);
 	Data ReadBinary(ifstream & F);
+	Data ReadBinary(const char*& src, const char* end);
 	Data _safemode(const Data& arg);
 	Data array(const Data& arg);
 	Data copy(const Data& arg);
@@ -88,6 +89,7 @@ namespace Evaluator
 	Data toreal(const Data& arg);
 	Data tostr(const Data& arg);
 	void tobinary(const Data& arg, ofstream & F);
+	void tobinary(const Data& arg, string& out);
 	Data toval(const Data& arg);
 	Data type_of(const Data& arg);
 	Data uc(const Data& args);
@@ -103,12 +105,46 @@ namespace Evaluator
 	Data net_create_server(const Data& arg);
 	Data net_get(const Data& arg);
 	Data net_isopen(const Data& arg);
+	Data net_protocol(const Data& arg);
 	Data net_send(const Data& arg);
 	Data net_server_close(const Data& arg);
 	Data net_server_get(const Data& arg);
+	Data net_server_get_all(const Data& arg);
+	Data net_server_high_water(const Data& arg);
 	Data net_server_isopen(const Data& arg);
+	Data net_server_max_connections(const Data& arg);
+	Data net_server_multicast(const Data& arg);
+	Data net_server_queued(const Data& arg);
 	Data net_server_send(const Data& arg);
 	Data net_server_send_all(const Data& arg);
+	Data net_server_send_many(const Data& arg);
+	Data net_server_update(const Data& arg);
+
+	namespace Libnet
+	{
+		/// Set the largest number of simultaneous server connections.
+		void SetMaxConnections(int n);
+		/// Set the high-water mark of output for new server connections.
+		void SetDefaultHighWater(size_t bytes);
+		/// Set the largest number of bytes received from a connection but not yet taken as messages.
+		void SetMaxInput(size_t bytes);
+		/// Set the largest payload of a binary frame sent or accepted.
+		void SetFrameMax(size_t bytes);
+		/// Create a new server context for hosting another server in the same process and return it's number.
+		int CreateServerContext();
+		/// Make the server context current for net_server_* functions.
+		void SelectServerContext(int context);
+		/// Close the server socket and all connections of the server context.
+		void CloseServerContext(int context);
+		/// If set, net_server_get() checks sockets once and returns immediately.
+		void SetServerPolling(bool polling);
+		/// Wait at most 'ms' milliseconds for activity in any server context. Return true if there is some.
+		bool WaitServerEvents(int ms);
+	}
+
+	// Metrics.
+	Data metrics_dump(const Data& arg);
+	Data metrics_values(const Data& arg);
 
 	// Card library.
 	Data attrs(const Data& args);
@@ -0,0 +1,339 @@
+/*
+    Gccg - Generic collectible card game.
+    Copyright (C) 2001,2002,2003,2004 Tommi Ronkainen
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program, in the file license.txt. If not, write
+  to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+  Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <algorithm>
+#include <deque>
+#include "parser.h"
+#include "metrics.h"
+
+using namespace Evaluator;
+
+/// Simulated client connection.
+struct LoadClient
+{
+	/// Connection number or -1 if not connected.
+	int con;
+	/// Position in the message script.
+	size_t line;
+	/// Time when the next message is due.
+	double next;
+	/// Sending times of messages still waiting for a reply.
+	deque<double> pending;
+};
+
+/// Call a network library function.
+static Data Call(const string& fn,const Data& arg)
+{
+	return (*external_function[fn])(arg);
+}
+
+/// Read message script. Empty lines and lines beginning with '#' are skipped.
+static vector<string> ReadScript(const string& file)
+{
+	ifstream F(file.c_str());
+	if(!F)
+		throw Error::IO("ReadScript(const string&)","file "+file+" not found");
+
+	vector<string> ret;
+	string s;
+	while(F)
+	{
+		s=Trim(readline(F));
+		if(s!="" && s[0]!='#')
+			ret.push_back(s);
+	}
+
+	return ret;
+}
+
+/// Replace each '$c' by the client number.
+static string Substitute(const string& s,int client)
+{
+	string ret;
+
+	for(size_t i=0; i<s.length(); i++)
+		if(s[i]=='$' && i+1 < s.length() && s[i+1]=='c')
+		{
+			ret+=ToString(client);
+			i++;
+		}
+		else
+			ret+=s[i];
+
+	return ret;
+}
+
+/// Return a percentile of sorted samples in milliseconds.
+static double Percentile(const vector<double>& sorted,double fraction)
+{
+	if(sorted.size()==0)
+		return 0.0;
+
+	size_t i=size_t(fraction*sorted.size());
+	if(i >= sorted.size())
+		i=sorted.size()-1;
+
+	return 1000.0*sorted[i];
+}
+
+static void usage()
+{
+	cout << "usage: loadgen [options]" << endl;
+	cout << "  options: --host <server host> (default localhost)" << endl;
+	cout << "           --port <server port> (default 29100)" << endl;
+	cout << "           --clients <number of simulated clients> (default 10)" << endl;
+	cout << "           --rate <total messages per second> (default 100)" << endl;
+	cout << "           --duration <seconds> (default 10)" << endl;
+	cout << "           --timeout <reply timeout in milliseconds> (default 5000)" << endl;
+	cout << "           --script <message script>" << endl;
+	cout << "           --protocol <text, binary or compressed> (default text)" << endl;
+	cout << endl;
+	cout << "  Message script has one message per line in script syntax. '$c' is" << endl;
+	cout << "  replaced by the client number and 'wait <ms>' pauses the client." << endl;
+	cout << "  Each client repeats the script. Without a script clients send" << endl;
+	cout << "  (\"Ping\",<number>) messages. Each message received is taken as the" << endl;
+	cout << "  reply to the oldest unanswered message of the client." << endl;
+	cout << "  After the run replies are awaited until the timeout and messages" << endl;
+	cout << "  still unanswered are counted as timeouts." << endl;
+}
+
+int main(int argc,char** argv)
+{
+	string host="localhost";
+	int port=29100,clients=10;
+	double rate=100.0,duration=10.0,timeout=5.0;
+	vector<string> script;
+	string protocol="text";
+
+	Evaluator::InitializeLibnet();
+	security.Disable();
+
+	try
+	{
+		for(int arg=1; arg<argc; arg++)
+		{
+			string opt=argv[arg];
+			if(arg+1 >= argc)
+			{
+				usage();
+				return 1;
+			}
+
+			if(opt=="--host")
+				host=argv[++arg];
+			else if(opt=="--port")
+				port=atoi(argv[++arg]);
+			else if(opt=="--clients")
+				clients=atoi(argv[++arg]);
+			else if(opt=="--rate")
+				rate=atof(argv[++arg]);
+			else if(opt=="--duration")
+				duration=atof(argv[++arg]);
+			else if(opt=="--timeout")
+				timeout=atof(argv[++arg])/1000.0;
+			else if(opt=="--script")
+				script=ReadScript(argv[++arg]);
+			else if(opt=="--protocol")
+				protocol=argv[++arg];
+			else
+			{
+				usage();
+				return 1;
+			}
+		}
+		if(clients < 1 || rate <= 0.0)
+		{
+			usage();
+			return 1;
+		}
+
+		// Connect clients.
+		vector<LoadClient> client(clients);
+		map<int,int> by_connection;
+		int connect_errors=0,close_errors=0,timeout_errors=0,send_errors=0;
+		long sent=0,received=0,unexpected=0;
+		vector<double> latency;
+
+		double start=Metrics::Now();
+		double interval=clients/rate;
+		for(int i=0; i<clients; i++)
+		{
+			Data con=Call("net_connect",Data(host,port));
+			client[i].con=con.IsInteger() ? con.Integer() : -1;
+			client[i].line=0;
+			// Spread clients evenly over the first interval.
+			client[i].next=start+interval*i/clients;
+			if(client[i].con < 0)
+				connect_errors++;
+			else
+			{
+				Call("net_protocol",Data(client[i].con,protocol));
+				by_connection[client[i].con]=i;
+			}
+		}
+
+		cout << "Connected " << clients-connect_errors << "/" << clients << " clients to " << host << ":" << port << endl;
+
+		start=Metrics::Now();
+		double end=start+duration,now,elapsed=0.0;
+		long seq=0;
+		bool draining=false;
+
+		while(true)
+		{
+			now=Metrics::Now();
+			if(!draining && now >= end)
+			{
+				// Stop sending and wait for the replies still pending.
+				draining=true;
+				elapsed=now-start;
+			}
+			if(draining)
+			{
+				bool waiting=false;
+				for(int i=0; i<clients && !waiting; i++)
+					waiting=(client[i].pending.size() > 0);
+				if(!waiting || now >= end+timeout)
+					break;
+			}
+
+			// Send all due messages, since receiving may wait for 10ms.
+			for(int i=0; i<clients && !draining; i++)
+			{
+				LoadClient& C=client[i];
+				while(C.con >= 0 && now >= C.next)
+				{
+					string msg;
+					if(script.size())
+					{
+						msg=script[C.line];
+						C.line=(C.line+1) % script.size();
+					}
+					else
+						msg="(\"Ping\","+ToString(int(seq++))+")";
+
+					if(msg.substr(0,5)=="wait ")
+					{
+						C.next=now+atof(msg.substr(5).c_str())/1000.0;
+						continue;
+					}
+
+					try
+					{
+						Call("net_send",Data(C.con,toval(Substitute(msg,i))));
+						C.pending.push_back(now);
+						sent++;
+					}
+					catch(Error::General e)
+					{
+						send_errors++;
+					}
+
+					C.next+=interval;
+					if(C.next < now)
+						C.next=now;
+				}
+			}
+
+			// Receive replies. Waits at most 10ms when nothing is available.
+			Data event;
+			while(!(event=Call("net_get",Null)).IsNull())
+			{
+				now=Metrics::Now();
+				if(event[0].IsString())
+				{
+					map<int,int>::iterator i=by_connection.find(event[1].Integer());
+					if(i!=by_connection.end())
+					{
+						// Replies to a closed client never arrive.
+						LoadClient& C=client[i->second];
+						timeout_errors+=(int)C.pending.size();
+						C.pending.clear();
+						C.con=-1;
+						by_connection.erase(i);
+						close_errors++;
+					}
+					continue;
+				}
+
+				map<int,int>::iterator i=by_connection.find(event[0].Integer());
+				if(i==by_connection.end())
+					continue;
+
+				LoadClient& C=client[i->second];
+				received++;
+				if(C.pending.size())
+				{
+					latency.push_back(now-C.pending.front());
+					C.pending.pop_front();
+				}
+				else
+					unexpected++;
+			}
+
+			// Drop replies that have not arrived in time.
+			now=Metrics::Now();
+			for(int i=0; i<clients; i++)
+			{
+				LoadClient& C=client[i];
+				while(C.pending.size() && now-C.pending.front() > timeout)
+				{
+					C.pending.pop_front();
+					timeout_errors++;
+				}
+			}
+		}
+
+		// Requests still unanswered at the end have timed out.
+		for(int i=0; i<clients; i++)
+		{
+			timeout_errors+=(int)client[i].pending.size();
+			if(client[i].con >= 0)
+				Call("net_close",client[i].con);
+		}
+
+		sort(latency.begin(),latency.end());
+		double sum=0.0;
+		for(size_t i=0; i<latency.size(); i++)
+			sum+=latency[i];
+
+		char buf[256];
+		sprintf(buf,"%.1f",sent/elapsed);
+		cout << "Sent " << sent << " messages in " << elapsed << " s (" << buf << " msg/s)" << endl;
+		sprintf(buf,"%.1f",received/elapsed);
+		cout << "Received " << received << " messages (" << buf << " msg/s), " << unexpected << " without pending request" << endl;
+		sprintf(buf,"avg %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms",
+			latency.size() ? 1000.0*sum/latency.size() : 0.0,Percentile(latency,0.5),
+			Percentile(latency,0.9),Percentile(latency,0.99),Percentile(latency,1.0));
+		cout << "Latency " << buf << endl;
+		cout << "Errors: " << connect_errors << " connect, " << send_errors << " send, "
+			 << close_errors << " closed, " << timeout_errors << " timeout" << endl;
+
+		return (connect_errors || send_errors || close_errors || timeout_errors) ? 2 : 0;
+	}
+	catch(Error::General e)
+	{
+		cerr << e.Message() << endl;
+		return 1;
+	}
+}
@@ -0,0 +1,277 @@
+/*
+    Gccg - Generic collectible card game.
+    Copyright (C) 2001,2002,2003,2004 Tommi Ronkainen
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program, in the file license.txt. If not, write
+  to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+  Boston, MA 02111-1307, USA.
+*/
+#include <stdio.h>
+#include <fstream>
+#if !defined(WIN32) && !defined(__WIN32__)
+# include <sys/time.h>
+#endif
+#include "metrics.h"
+#include "security.h"
+#include "parser.h"
+#include "parser_functions.h"
+
+namespace Evaluator
+{
+	Metrics metrics;
+
+	/// Upper bounds of histogram buckets in seconds. The last bucket is unbounded.
+	static const double bucket_limit[METRICS_BUCKETS-1]=
+	{
+		0.0001,0.0002,0.0005,0.001,0.002,0.005,0.01,0.02,
+		0.05,0.1,0.2,0.5,1.0,2.0,5.0
+	};
+
+	// MetricsHistogram
+	// ================
+
+	MetricsHistogram::MetricsHistogram()
+	{
+		count=0;
+		total=0.0;
+		max=0.0;
+		for(int i=0; i<METRICS_BUCKETS; i++)
+			bucket[i]=0;
+	}
+
+	void MetricsHistogram::Add(double seconds)
+	{
+		int i=0;
+		while(i < METRICS_BUCKETS-1 && seconds > bucket_limit[i])
+			i++;
+
+		bucket[i]++;
+		count++;
+		total+=seconds;
+		if(seconds > max)
+			max=seconds;
+	}
+
+	double MetricsHistogram::Percentile(double fraction) const
+	{
+		long n=0;
+
+		for(int i=0; i<METRICS_BUCKETS-1; i++)
+		{
+			n+=bucket[i];
+			if(n >= fraction*count)
+				return bucket_limit[i] < max ? bucket_limit[i] : max;
+		}
+
+		return max;
+	}
+
+	// Metrics
+	// =======
+
+	Metrics::Metrics()
+	{
+		enabled=false;
+		dump_interval=0;
+		dump_time=0;
+	}
+
+	double Metrics::Now()
+	{
+#if defined(WIN32) || defined(__WIN32__)
+		return double(clock())/CLOCKS_PER_SEC;
+#else
+		timeval t;
+		gettimeofday(&t,0);
+
+		return t.tv_sec + t.tv_usec/1000000.0;
+#endif
+	}
+
+	void Metrics::Gauge(const string& name,double value)
+	{
+		if(!enabled)
+			return;
+
+		MetricsGauge& g=gauge[name];
+		g.value=value;
+		if(value > g.max)
+			g.max=value;
+	}
+
+	void Metrics::AddGauge(const string& name,double delta)
+	{
+		if(!enabled)
+			return;
+
+		MetricsGauge& g=gauge[name];
+		g.value+=delta;
+		if(g.value > g.max)
+			g.max=g.value;
+	}
+
+	void Metrics::Reset()
+	{
+		counter.clear();
+		histogram.clear();
+
+		// Keep current values of gauges, since they describe the state.
+		map<string,MetricsGauge>::iterator i;
+		for(i=gauge.begin(); i!=gauge.end(); i++)
+			i->second.max=i->second.value;
+	}
+
+	Data Metrics::Values() const
+	{
+		map<string,Data> values;
+
+		map<string,double>::const_iterator c;
+		for(c=counter.begin(); c!=counter.end(); c++)
+			values[c->first]=c->second;
+
+		map<string,MetricsGauge>::const_iterator g;
+		for(g=gauge.begin(); g!=gauge.end(); g++)
+			values[g->first]=Data(g->second.value,g->second.max);
+
+		// Histograms are (count,average ms,max ms,50% ms,90% ms,99% ms).
+		map<string,MetricsHistogram>::const_iterator h;
+		for(h=histogram.begin(); h!=histogram.end(); h++)
+		{
+			const MetricsHistogram& H=h->second;
+			Data v;
+			v.MakeList(6);
+			v[0]=int(H.count);
+			v[1]=H.count ? 1000.0*H.total/H.count : 0.0;
+			v[2]=1000.0*H.max;
+			v[3]=1000.0*H.Percentile(0.5);
+			v[4]=1000.0*H.Percentile(0.9);
+			v[5]=1000.0*H.Percentile(0.99);
+			values[h->first]=v;
+		}
+
+		Data ret;
+		ret.MakeList(values.size());
+
+		size_t n=0;
+		map<string,Data>::const_iterator i;
+		for(i=values.begin(); i!=values.end(); i++)
+			ret[n++]=Data(i->first,i->second);
+
+		return ret;
+	}
+
+	void Metrics::SetDump(const string& file,int interval)
+	{
+		dump_file=file;
+		dump_interval=interval > 0 ? interval : 60;
+		dump_time=::time(0);
+	}
+
+	void Metrics::Tick()
+	{
+		if(dump_file=="" || ::time(0) - dump_time < dump_interval)
+			return;
+
+		dump_time=::time(0);
+		Dump(dump_file);
+	}
+
+	void Metrics::Dump(const string& file) const
+	{
+		string tmp=file+".tmp";
+		ofstream f(tmp.c_str());
+		if(!f)
+			throw Error::IO("Metrics::Dump(const string&)","unable to write "+tmp);
+
+		char line[256];
+		time_t now=::time(0);
+		f << "# " << ctime(&now);
+
+		map<string,double>::const_iterator c;
+		for(c=counter.begin(); c!=counter.end(); c++)
+		{
+			sprintf(line,"%.0f",c->second);
+			f << c->first << " " << line << endl;
+		}
+
+		map<string,MetricsGauge>::const_iterator g;
+		for(g=gauge.begin(); g!=gauge.end(); g++)
+		{
+			sprintf(line,"%g max=%g",g->second.value,g->second.max);
+			f << g->first << " " << line << endl;
+		}
+
+		map<string,MetricsHistogram>::const_iterator h;
+		for(h=histogram.begin(); h!=histogram.end(); h++)
+		{
+			const MetricsHistogram& H=h->second;
+			sprintf(line,"count=%ld avg=%.3fms p50=%.3fms p90=%.3fms p99=%.3fms max=%.3fms",
+				H.count,H.count ? 1000.0*H.total/H.count : 0.0,1000.0*H.Percentile(0.5),
+				1000.0*H.Percentile(0.9),1000.0*H.Percentile(0.99),1000.0*H.max);
+			f << h->first << " " << line << endl;
+		}
+
+		f.close();
+		if(rename(tmp.c_str(),file.c_str())!=0)
+			throw Error::IO("Metrics::Dump(const string&)","unable to rename "+tmp);
+	}
+
+// Library functions
+
+	/// metrics_values() - Return a dictionary of all recorded metrics. Counters
+	/// are numbers, gauges are pairs (current value,largest value) and
+	/// latency histograms are lists (count,average ms,max ms,50\% ms,90\%
+	/// ms,99\% ms). If the argument is "reset", clear counters and
+	/// histograms after returning their values.
+	Data metrics_values(const Data& arg)
+	{
+		if(!arg.IsNull() && !(arg.IsString() && arg.String()=="reset"))
+			ArgumentError("metrics_values",arg);
+
+		Data ret=metrics.Values();
+		if(!arg.IsNull())
+			metrics.Reset();
+
+		return ret;
+	}
+
+	/// metrics_dump(f,t) - Write all metrics to the file $f$ every $t$
+	/// seconds. If $f$ is NULL, stop dumping. If $t$ is not given, write
+	/// the file once now.
+	Data metrics_dump(const Data& arg)
+	{
+		if(arg.IsNull())
+		{
+			metrics.SetDump("",0);
+			return Null;
+		}
+
+		string file;
+		if(arg.IsString())
+			file=arg.String();
+		else if(arg.IsList(2) && arg[0].IsString() && arg[1].IsInteger())
+			file=arg[0].String();
+		else
+			ArgumentError("metrics_dump",arg);
+
+		security.WriteFile(file);
+
+		if(arg.IsString())
+			metrics.Dump(file);
+		else
+			metrics.SetDump(file,arg[1].Integer());
+
+		return Null;
+	}
+}
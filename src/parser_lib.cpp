@@ -22,6 +22,7 @@
 #include <algorithm>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #if !defined(__BCPLUSPLUS__) && !defined(_MSC_VER)
 # include <sys/time.h>
@@ -47,6 +48,9 @@
 // binary buff size
 #define GCCG_RBBUF 1024
 
+// deepest nesting of lists read from memory
+#define GCCG_MAX_DEPTH 256
+
 
 using namespace std;
 
@@ -363,6 +367,88 @@ namespace Evaluator
 			throw LangErr("tobinary", "Write error");
 	}
 
+	// Return true if numbers are stored least significant byte first.
+	static bool LittleEndian()
+	{
+		int one=1;
+		return *(const char*)&one==1;
+	}
+
+	// Append a number as 4 bytes in big endian order.
+	static void AppendWord(string& out, int value)
+	{
+		unsigned int v=value;
+		out+=char(v >> 24);
+		out+=char(v >> 16);
+		out+=char(v >> 8);
+		out+=char(v);
+	}
+
+	// Read a number stored by AppendWord().
+	static int ReadWord(const char* src)
+	{
+		const unsigned char* b=(const unsigned char*)src;
+		return int((unsigned int)b[0] << 24 | (unsigned int)b[1] << 16 | (unsigned int)b[2] << 8 | (unsigned int)b[3]);
+	}
+
+	// Append a real number as 8 bytes in big endian order.
+	static void AppendReal(string& out, double value)
+	{
+		char b[sizeof(double)];
+		memcpy(b, &value, sizeof(double));
+		if ( LittleEndian() )
+			std::reverse(b, b+sizeof(double));
+		out.append(b, sizeof(double));
+	}
+
+	// Read a real number stored by AppendReal().
+	static double ReadReal(const char* src)
+	{
+		char b[sizeof(double)];
+		double value;
+		memcpy(b, src, sizeof(double));
+		if ( LittleEndian() )
+			std::reverse(b, b+sizeof(double));
+		memcpy(&value, b, sizeof(double));
+		return value;
+	}
+
+	/// Append the binary form of the element to a string. The format
+	/// is the same as in the stream version, except that numbers are
+	/// in big endian order, so that it can be read on any machine.
+	void tobinary(const Data& arg, string& out)
+	{
+		int sz;
+		if(arg.IsString()) {
+			const string& s=arg.String();
+			sz=s.size()+1;
+			out+=char(GCCG_STRING);
+			AppendWord(out, sz);
+			out.append(s.c_str(), sz);
+		}
+		else if(arg.IsNull()) {
+			out+=char(GCCG_NULL);
+		}
+		else if(arg.IsReal()) {
+			out+=char(GCCG_DOUBLE);
+			AppendReal(out, arg.Real());
+		}
+		else if(arg.IsInteger()) {
+			out+=char(GCCG_INT);
+			AppendWord(out, arg.Integer());
+		}
+		else if(arg.IsList()) {
+			const Data& L=arg;
+			sz=L.Size();
+			out+=char(GCCG_LIST);
+			AppendWord(out, sz);
+
+			for(size_t i=0; i<L.Size(); i++) {
+				tobinary(L[i], out);
+			}
+		}
+	}
+
 	/// tostr(e) - Convert any element to string. This string is in
 	/// such format that it produces element $e$ when evaluated.
 	Data tostr(const Data& arg)
@@ -824,6 +910,71 @@ namespace Evaluator
 
 	}
 
+	// Read an element nested in 'depth' lists. Data from the network
+	// may nest deeply enough to exhaust the stack, so limit the depth.
+	static Data ReadBinary(const char*& src, const char* end, int depth)
+	{
+		int i=0;
+		double d=0;
+
+		if ( depth > GCCG_MAX_DEPTH ) throw Error::Invalid("ReadBinary", "Too deeply nested lists");
+		if ( src >= end ) throw LangErr("ReadBinary", "Cannot read element type");
+		unsigned char ch=*src++;
+		switch(ch) {
+			case GCCG_NULL:
+				return Null;
+
+			case GCCG_STRING:
+				if ( end-src < 4 ) throw LangErr("ReadBinary", "Cannot read string length");
+				i=ReadWord(src);
+				src+=4;
+				if ( i < 1 || end-src < i ) throw LangErr("ReadBinary", "Cannot read string");
+				src+=i;
+				return string(src-i, i-1);
+
+			case GCCG_INT:
+				if ( end-src < 4 ) throw LangErr("ReadBinary", "Cannot read integer");
+				i=ReadWord(src);
+				src+=4;
+				return i;
+
+			case GCCG_DOUBLE:
+				if ( end-src < (int)sizeof(double) ) throw LangErr("ReadBinary", "Cannot read real");
+				d=ReadReal(src);
+				src+=sizeof(double);
+				return d;
+
+			case GCCG_LIST:
+			{
+				if ( end-src < 4 ) throw LangErr("ReadBinary", "Cannot read list size");
+				i=ReadWord(src);
+				src+=4;
+
+				// Each element takes at least one byte.
+				if ( i < 0 || end-src < i ) {
+					throw LangErr("ReadBinary","invalid count");
+				}
+
+				Data ret;
+				ret.MakeList(i);
+				for(int k=0; k<i; k++)
+					ret[k]=ReadBinary(src, end, depth+1);
+
+				return ret;
+			}
+
+			default:
+				throw LangErr("ReadBinary", "Invalid element type");
+		}
+	}
+
+	/// Read an element in binary form from memory between 'src' and
+	/// 'end'. Move 'src' past the element.
+	Data ReadBinary(const char*& src, const char* end)
+	{
+		return ReadBinary(src, end, 0);
+	}
+
 	Data ReadLiteral(const char*& src)
 	{		
 		while(*src && isspace(*src))
@@ -20,22 +20,93 @@
 
 #include <list>
 #include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
 #include <time.h>
+#include <ctype.h>
+#include <string.h>
 #include <signal.h>
+#if !defined(WIN32)
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <stdint.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+# include <sys/resource.h>
+#endif
 #include "SDL_net.h"
+// Socket descriptors are taken from the SDL_net socket structure,
+// whose layout is known only for SDL_net 1.2 releases.
+#if !defined(WIN32) && defined(SDL_NET_MAJOR_VERSION) && SDL_NET_MAJOR_VERSION==1 && SDL_NET_MINOR_VERSION==2 && SDL_NET_PATCHLEVEL<=8
+# define USE_SOCKET_FD
+#endif
+#if defined(__linux__) && defined(USE_SOCKET_FD) && !defined(NO_EPOLL)
+# define USE_EPOLL
+#endif
+#ifdef USE_EPOLL
+# include <sys/epoll.h>
+# include <sys/eventfd.h>
+#endif
 #include "SDL_thread.h"
 #include "parser.h"
+#include "metrics.h"
+#include "compress.h"
 
+// Default limit of server connections and the limit of client connections.
 #define MAX_CONNECTIONS 1024
+#define MAX_SERVER_CONTEXTS 64
+
+// Epoll event tags of server sockets and the wake up descriptor. Client
+// connections are tagged by their number.
+#define EPOLL_SERVER_TAG 0x40000000
+#define EPOLL_WAKE_TAG 0x80000000
+#define EPOLL_EVENTS 256
+
+// Maximum number of buffers written by one system call.
+#define WRITE_IOV 64
+
+// Binary protocol. A client asks for binary frames by sending
+// PROTOCOL_BINARY or PROTOCOL_COMPRESSED as a text line. Server replies
+// with the same line before its first frame. Client keeps sending text
+// until it has read the reply and then repeats the line before its
+// first frame, so a server not knowing the protocol never gets frames.
+// Frame begins with the payload length as 4 byte big endian
+// number, whose highest bit is set if the payload is compressed by
+// LZCompress(). Payload is the value in the format of tobinary(), whose
+// numbers are big endian, too.
+// Compressed protocol compresses payloads of COMPRESS_THRESHOLD bytes
+// or more. A connection sending a payload longer than the frame limit,
+// FRAME_MAX by default, is dropped.
+#define PROTOCOL_BINARY "#protocol binary"
+#define PROTOCOL_COMPRESSED "#protocol compressed"
+#define FRAME_HEADER 4
+#define FRAME_COMPRESSED 0x80000000UL
+#define FRAME_MAX 4*1024*1024
+#define COMPRESS_THRESHOLD 1024
+// LZCompress() never shrinks data more than this, since each length
+// byte of a match adds at most 255 bytes to the output.
+#define COMPRESS_RATIO_MAX 256
+
+#if !defined(MSG_NOSIGNAL)
+# define MSG_NOSIGNAL 0
+#endif
 
-#ifdef WIN32
-// Buffer size is way overkill and would cause stackoverflows on Windows.
-// Check with Tommi if this it really needs a 1MB buffer...
-#define BUFFER_SIZE 128*1024
+#if defined(__GNUC__)
+# define ATOMIC_INC(x) __sync_add_and_fetch(&(x),1)
+# define ATOMIC_DEC(x) __sync_sub_and_fetch(&(x),1)
 #else
-#define BUFFER_SIZE 1024*1024
+# include <windows.h>
+# define ATOMIC_INC(x) InterlockedIncrement(&(x))
+# define ATOMIC_DEC(x) InterlockedDecrement(&(x))
 #endif
 
+// Minimum free space of a receive buffer before reading from a socket.
+#define READ_SIZE 16*1024
+// Default limit of data received from a connection but not yet taken as messages.
+#define MAX_INPUT 4*1024*1024
+
 typedef void (*sighandler_t)(int);
 
 //
@@ -47,34 +118,340 @@ namespace Evaluator
 	namespace Libnet
 	{
 // Server variables
-		static bool server_created=false; // Only one server needed.
-		static IPaddress serverIP; // IP address of the server.
-		static TCPsocket servsock = NULL; // Server socket.
+		struct ServerContext {
+			bool created; // Server socket is created.
+			IPaddress serverIP; // IP address of the server.
+			TCPsocket servsock; // Server socket.
+			list<Data> events; // Events received from server sockets.
+			string last_event; // Type of the event returned by net_server_get() last time.
+			double last_event_time; // Time when the last event was returned.
+			vector<int> finishing; // Connections whose "close" event was returned in a batch but are not finished yet.
+		};
+
+		static ServerContext contexts[MAX_SERVER_CONTEXTS]; // Servers hosted by this process.
+		static int server_contexts=1; // Number of server contexts in use.
+		static int current_context=0; // Context used by net_server_* functions.
+		static bool server_polling=false; // If set, net_server_get() does not wait.
+		static size_t frame_max=FRAME_MAX; // Largest payload of a binary frame, compressed or not.
 		static SDLNet_SocketSet socketset = NULL; // Current socket set to listen.
 
+		// Message formats of connections.
+		enum {FORMAT_TEXT,FORMAT_BINARY,FORMAT_COMPRESSED};
+
+		// Return the line selecting the binary message format.
+		static const char* ProtocolLine(int format)
+		{
+			return format==FORMAT_COMPRESSED ? PROTOCOL_COMPRESSED : PROTOCOL_BINARY;
+		}
+
+		// Store a frame header at position 'pos' of 'out'.
+		static void SetFrameHeader(string& out,size_t pos,unsigned long header)
+		{
+			out[pos]=char(header >> 24);
+			out[pos+1]=char(header >> 16);
+			out[pos+2]=char(header >> 8);
+			out[pos+3]=char(header);
+		}
+
+		// Append a binary frame containing the value to 'out'.
+		static void AppendFrame(string& out,const Data& value)
+		{
+			size_t start=out.size();
+			out.append(FRAME_HEADER,'\0');
+			tobinary(value,out);
+
+			size_t len=out.size()-start-FRAME_HEADER;
+			if(len > frame_max)
+				throw LangErr("AppendFrame","message too large");
+			SetFrameHeader(out,start,len);
+		}
+
+		// Store a compressed copy of a frame made by AppendFrame() to
+		// 'out'. Return false, if the payload is too short for
+		// compression or does not shrink.
+		static bool CompressFrame(const string& frame,string& out)
+		{
+			size_t len=frame.size()-FRAME_HEADER;
+			if(len < COMPRESS_THRESHOLD)
+				return false;
+
+			string packed(FRAME_HEADER,'\0');
+			LZCompress(frame.data()+FRAME_HEADER,len,packed);
+			size_t packed_len=packed.size()-FRAME_HEADER;
+			if(packed_len >= len)
+				return false;
+
+			SetFrameHeader(packed,0,packed_len | FRAME_COMPRESSED);
+			out.swap(packed);
+			metrics.Count("net.frames_compressed");
+			metrics.Count("net.bytes_saved",len-packed_len);
+
+			return true;
+		}
+
+		// Decode the payload of a binary frame to the value delivered
+		// by a message event. Strings are delivered in text form, so
+		// that toval() gives the same result for both protocols.
+		static Data DecodeFrame(const char* payload,size_t size,bool compressed)
+		{
+			string unpacked;
+			if(compressed)
+			{
+				// Do not trust the length in the payload, which would
+				// allow a small frame to allocate the whole frame limit.
+				LZDecompress(payload,size,unpacked,std::min(frame_max,size*COMPRESS_RATIO_MAX));
+				payload=unpacked.data();
+				size=unpacked.size();
+			}
+
+			const char* end=payload+size;
+			Data value=ReadBinary(payload,end);
+			if(payload!=end)
+				throw LangErr("DecodeFrame","extra data in frame");
+
+			return value.IsString() ? tostr(value) : value;
+		}
+
+		// Message to be sent. The encodings are made when the message
+		// is queued to a connection needing them. They are shared by all
+		// connections the message is sent to and released when the last
+		// one has written it.
+		class Message {
+			struct Shared {
+				const Data* value; // Value to encode, valid only while the message is queued.
+				string text; // Newline terminated text form.
+				string frame; // Binary frame.
+				string compressed; // Compressed frame or empty if not compressed.
+				bool compress_tried; // Compression of the frame has been tried.
+				volatile long refs;
+			};
+			Shared* shared;
+			int format; // Encoding the message refers to.
+
+			void Release()
+				{if(shared && ATOMIC_DEC(shared->refs)==0) delete shared;}
+
+		  public:
+
+			// Create a message sending the value. The value must exist
+			// until the message has been queued.
+			explicit Message(const Data& value)
+				{shared=new Shared; shared->value=&value; shared->compress_tried=false; shared->refs=1; format=FORMAT_TEXT;}
+			Message(const Message& m)
+				{shared=m.shared; format=m.format; ATOMIC_INC(shared->refs);}
+			~Message()
+				{Release();}
+			Message& operator=(const Message& m)
+				{ATOMIC_INC(m.shared->refs); Release(); shared=m.shared; format=m.format; return *this;}
+
+			// Create a message sending a line of text as is.
+			static Message Line(const string& line)
+				{Message m(Null); m.shared->text=line+"\n"; m.shared->value=0; return m;}
+
+			// Return the message encoded for a connection using the format.
+			Message Encoded(int format) const
+			{
+				Message m(*this);
+				m.format=format;
+
+				if(format==FORMAT_TEXT)
+				{
+					if(shared->text.empty())
+					{
+						shared->text=tostr(*shared->value).String();
+						shared->text+='\n';
+					}
+					return m;
+				}
+
+				if(shared->frame.empty())
+					AppendFrame(shared->frame,*shared->value);
+				if(format==FORMAT_COMPRESSED)
+				{
+					if(!shared->compress_tried)
+					{
+						shared->compress_tried=true;
+						CompressFrame(shared->frame,shared->compressed);
+					}
+					if(shared->compressed.empty())
+						m.format=FORMAT_BINARY;
+				}
+
+				return m;
+			}
+
+			// Return the encoded message as sent.
+			const string& String() const
+			{
+				if(format==FORMAT_TEXT)
+					return shared->text;
+				return format==FORMAT_COMPRESSED ? shared->compressed : shared->frame;
+			}
+		};
+
+		// Data received from a connection. Socket is read directly to
+		// the end of the buffer and complete lines are taken from the
+		// beginning. The buffer grows as needed for long lines.
+		class ReceiveBuffer {
+			vector<char> data;
+			size_t begin; // Start of unprocessed data.
+			size_t end; // End of received data.
+
+		  public:
+
+			ReceiveBuffer()
+				{begin=0; end=0;}
+
+			// Drop all data and release memory.
+			void Clear()
+				{vector<char>().swap(data); begin=0; end=0;}
+			// Return true if there is no unprocessed data.
+			bool Empty() const
+				{return begin==end;}
+			// Return the number of bytes of unprocessed data.
+			size_t Size() const
+				{return end-begin;}
+			// Return space for reading at least 'n' bytes.
+			char* Space(size_t n)
+			{
+				if(begin && data.size()-end < n)
+				{
+					memmove(&data[0],&data[begin],end-begin);
+					end-=begin;
+					begin=0;
+				}
+				if(data.size()-end < n)
+					data.resize(std::max(2*data.size(),end+n));
+
+				return &data[end];
+			}
+			// Return the size of the space returned by Space().
+			size_t SpaceSize() const
+				{return data.size()-end;}
+			// Add 'n' bytes read to the space.
+			void Received(size_t n)
+				{end+=n;}
+			// Take the next complete line without newline and carriage
+			// returns. Return false if there is none.
+			bool Line(string& line)
+			{
+				if(begin==end)
+					return false;
+
+				const char* start=&data[begin];
+				const char* nl=(const char*)memchr(start,'\n',end-begin);
+				if(nl==0)
+					return false;
+
+				line.assign(start,nl);
+				if(memchr(start,'\r',nl-start))
+					line.erase(std::remove(line.begin(),line.end(),'\r'),line.end());
+
+				begin+=nl-start+1;
+				if(begin==end)
+					begin=end=0;
+
+				return true;
+			}
+			// Take the next complete binary frame. Return 1 and set
+			// 'payload' and 'size' to its payload, which is valid until
+			// more data is read. Return 0 if there is none and -1 if the
+			// frame header is invalid.
+			int Frame(const char*& payload,size_t& size,bool& compressed)
+			{
+				if(end-begin < FRAME_HEADER)
+					return 0;
+
+				const unsigned char* h=(const unsigned char*)&data[begin];
+				size_t len=(size_t(h[0] & 0x7f) << 24) | (size_t(h[1]) << 16) | (size_t(h[2]) << 8) | size_t(h[3]);
+				compressed=(h[0] & 0x80)!=0;
+				if(len > frame_max)
+					return -1;
+				if(end-begin < FRAME_HEADER+len)
+					return 0;
+
+				payload=&data[begin+FRAME_HEADER];
+				size=len;
+				begin+=FRAME_HEADER+len;
+				if(begin==end)
+					begin=end=0;
+
+				return 1;
+			}
+			// Take the unterminated data left in the buffer.
+			string Rest()
+			{
+				string line(data.begin()+begin,data.begin()+end);
+				line.erase(std::remove(line.begin(),line.end(),'\r'),line.end());
+				begin=end=0;
+
+				return line;
+			}
+		};
+
 		struct ClientData {
 			SDL_mutex *lock; // Mutex to lock this entry.
 			int number; // Connection number.
 			TCPsocket sock; // Client socket.
 			IPaddress peer; // Clint address.
-			string read_buffer; // Buffer for reading.
-			string write_buffer; // Buffer for writing.
+			ReceiveBuffer input; // Data received but not yet split into messages.
+			deque<Message> output; // Messages waiting for writing.
+			size_t output_offset; // Bytes of the first message already written.
+			size_t output_bytes; // Bytes waiting for writing, including those taken by the writer thread.
+			unsigned long output_first; // Sequence number of the first message in the output.
+			map<string,unsigned long> updates; // Sequence numbers of replaceable updates by their keys.
+			size_t high_water; // Output size causing the event "slow" or 0 for no limit.
+			bool slow; // Output has exceeded the high-water mark and not yet drained to half of it.
 			SDL_sem *wait; // This semphore signals (value 1) when there are events for writer thread.
 			bool writing; // This flag is set when writer thread is writing to the socket.
 			bool writer_eof; // Writer thread can exit when finished.
 			bool writer_pipe; // Writer have encountered an error.
 			bool closed; // Socket is going to close soon. Don't append data to write buffer anymore.
+			int format; // Message format used after the protocol has been selected.
+			bool framed; // Client has confirmed the protocol and sends frames.
+			int context; // Server context owning the connection.
+			int active_index; // Position of the connection in the list of active connections.
 			SDL_Thread *writer_thread; // Thread performing writing.
+#ifdef USE_EPOLL
+			unsigned int watched; // Epoll events registered for the socket.
+			bool queued; // Connection is in the list of pending writes.
+#endif
 		};
 		
-		static ClientData people[MAX_CONNECTIONS];
+		static deque<ClientData> people; // Connection table. Entries never move when it grows.
+		static vector<int> free_clients; // Unused entries of the connection table.
+		static vector<int> active_clients; // Entries having a connection or closing one.
+		static int max_connections=MAX_CONNECTIONS; // Largest size of the connection table.
+		static size_t default_high_water=0; // High-water mark of new connections.
+		static size_t max_input=MAX_INPUT; // Largest unprocessed input of a connection.
+		static double queue_metrics_time=0.0; // Time when output sizes were recorded last time.
+#ifndef USE_EPOLL
+		static vector<int> closing_clients; // Connections waiting for the writer thread to close the socket.
+		static int socketset_size=0; // Number of sockets fitting in the socket set.
+#endif
+
+#ifdef USE_SOCKET_FD
+		// Beginning of the SDL_net 1.2 TCP socket structure. SDL_net does
+		// not export socket descriptors needed by epoll and writev().
+		struct SDLNetSocket {
+			int ready;
+			int channel;
+		};
+#endif
+
+#ifdef USE_EPOLL
+		static int epoll_fd=-1; // Epoll instance listening server sockets.
+		static int wake_fd=-1; // Event descriptor which interrupts epoll_wait() on signals.
+		static vector<int> pending_writes; // Connections with unsent data not waiting for writability.
+#endif
 		
-		static list<Data> server_event_buffer; // Events received from server sockets.
 
 // Client variables
 		static SDLNet_SocketSet client_socketset = NULL;
 		static vector<TCPsocket> connections;
-		static string client_buffer[MAX_CONNECTIONS];
+		static vector<ReceiveBuffer> client_buffer;
+		static vector<int> client_format; // Format of messages selected for each connection.
+		static vector<bool> client_framed; // Server has acknowledged the format, so both sides use it.
 		static list<Data> event_buffer;
 
 // Support functions
@@ -89,8 +466,467 @@ namespace Evaluator
 		{
 			cout << "Warning: Signal " << s << " received." << endl;
 			Evaluator::quitsignal=true;
+#ifdef USE_EPOLL
+			// Signal may be delivered to a writer thread, so wake up the main thread explicitly.
+			if(wake_fd >= 0)
+			{
+				uint64_t one=1;
+				ssize_t ret=write(wake_fd,&one,sizeof(one));
+				(void)ret;
+			}
+#endif
+		}
+
+#ifdef USE_SOCKET_FD
+		// Return the descriptor of an SDL_net socket.
+		static int SocketFD(TCPsocket sock)
+		{
+			return ((SDLNetSocket*)sock)->channel;
+		}
+
+		// Write queued messages to the socket, as much as it accepts
+		// without blocking if it is non-blocking. Messages written
+		// completely are removed and 'offset' is updated to the number
+		// of bytes written from the first message. Number of bytes
+		// written is added to 'written'. Return false on write error.
+		static bool WriteMessages(int fd,deque<Message>& queue,size_t& offset,size_t& written)
+		{
+			iovec iov[WRITE_IOV];
+
+			while(queue.size())
+			{
+				int n=0;
+				for(size_t k=0; k<queue.size() && n < WRITE_IOV; k++)
+				{
+					const string& s=queue[k].String();
+					size_t skip=(k==0 ? offset : 0);
+					iov[n].iov_base=(char*)s.data()+skip;
+					iov[n].iov_len=s.length()-skip;
+					n++;
+				}
+
+				msghdr msg;
+				memset(&msg,0,sizeof(msg));
+				msg.msg_iov=iov;
+				msg.msg_iovlen=n;
+
+				ssize_t len=sendmsg(fd,&msg,MSG_NOSIGNAL);
+				if(len < 0)
+				{
+					if(errno==EINTR)
+						continue;
+					if(errno==EAGAIN || errno==EWOULDBLOCK)
+						return true;
+					return false;
+				}
+
+				// Remove messages written.
+				written+=len;
+				size_t left=len;
+				while(left)
+				{
+					size_t rest=queue.front().String().length()-offset;
+					if(left < rest)
+					{
+						offset+=left;
+						break;
+					}
+					left-=rest;
+					offset=0;
+					queue.pop_front();
+				}
+			}
+
+			return true;
+		}
+#endif
+
+		// Start listening a server socket or a client connection. Tag
+		// identifies the socket in epoll events.
+		static void Watch(TCPsocket sock,unsigned int tag)
+		{
+#ifdef USE_EPOLL
+			epoll_event ev;
+			ev.events=EPOLLIN;
+			ev.data.u64=0;
+			ev.data.u32=tag;
+			if(epoll_ctl(epoll_fd,EPOLL_CTL_ADD,SocketFD(sock),&ev)!=0)
+				cerr << "ERROR: epoll_ctl failed" << endl;
+#else
+			SDLNet_TCP_AddSocket(socketset, sock);
+#endif
+		}
+
+		// Stop listening a socket.
+		static void Unwatch(TCPsocket sock)
+		{
+			if(sock == NULL)
+				return;
+#ifdef USE_EPOLL
+			epoll_event ev;
+			epoll_ctl(epoll_fd,EPOLL_CTL_DEL,SocketFD(sock),&ev);
+#else
+			SDLNet_TCP_DelSocket(socketset, sock);
+#endif
+		}
+
+		// Return true if server sockets can be listened.
+		static bool ServerInitialized()
+		{
+#ifdef USE_EPOLL
+			return epoll_fd >= 0;
+#else
+			return socketset != NULL;
+#endif
+		}
+
+#ifndef USE_EPOLL
+		// Replace the socket set by a new one holding 'size' sockets and
+		// add all listened sockets to it.
+		static void ResizeSocketSet(int size)
+		{
+			SDLNet_SocketSet set=SDLNet_AllocSocketSet(size);
+			if(set == NULL)
+				throw LangErr("ResizeSocketSet","couldn't create socket set");
+			if(socketset != NULL)
+				SDLNet_FreeSocketSet(socketset);
+			socketset=set;
+			socketset_size=size;
+
+			for(int c=0; c<server_contexts; c++)
+				if(contexts[c].created)
+					SDLNet_TCP_AddSocket(socketset, contexts[c].servsock);
+
+			for(size_t k=0; k<active_clients.size(); k++)
+			{
+				ClientData& client=people[active_clients[k]];
+				SDL_LockMutex(client.lock);
+				if(client.sock && !client.writer_eof)
+					SDLNet_TCP_AddSocket(socketset, client.sock);
+				SDL_UnlockMutex(client.lock);
+			}
+		}
+
+		// Return entries to the free list after writer threads have
+		// closed their sockets.
+		static void ReleaseClient(int i);
+		static void ReclaimClients()
+		{
+			for(size_t k=0; k<closing_clients.size(); )
+			{
+				int i=closing_clients[k];
+				SDL_LockMutex(people[i].lock);
+				bool closed=people[i].sock==NULL;
+				SDL_UnlockMutex(people[i].lock);
+
+				if(closed)
+				{
+					ReleaseClient(i);
+					closing_clients[k]=closing_clients.back();
+					closing_clients.pop_back();
+				}
+				else
+					k++;
+			}
+		}
+#endif
+
+		// Take an entry of the connection table for a new connection
+		// and add it to the active connections. The table grows until
+		// it reaches the connection limit. Return -1 if there is no room.
+		static int AllocateClient()
+		{
+#ifndef USE_EPOLL
+			ReclaimClients();
+#endif
+			if(free_clients.empty())
+			{
+				if((int)people.size() >= max_connections)
+					return -1;
+
+				people.push_back(ClientData());
+				ClientData& client=people.back();
+				client.lock=SDL_CreateMutex();
+				client.wait=SDL_CreateSemaphore(0);
+				client.writer_thread=NULL;
+				client.sock=NULL;
+				free_clients.push_back(people.size()-1);
+#ifndef USE_EPOLL
+				if((int)people.size()+MAX_SERVER_CONTEXTS > socketset_size)
+					ResizeSocketSet(2*socketset_size);
+#endif
+			}
+
+			int i=free_clients.back();
+			free_clients.pop_back();
+			people[i].active_index=active_clients.size();
+			active_clients.push_back(i);
+
+			return i;
+		}
+
+		// Remove a connection without socket from the active
+		// connections and make the entry free.
+		static void ReleaseClient(int i)
+		{
+			int last=active_clients.back();
+			active_clients[people[i].active_index]=last;
+			people[last].active_index=people[i].active_index;
+			active_clients.pop_back();
+			free_clients.push_back(i);
+		}
+
+		// Drop all messages waiting in the output of the connection.
+		static void ClearOutput(ClientData& client)
+		{
+			client.output_first+=client.output.size();
+			client.output.clear();
+			client.output_offset=0;
+			client.output_bytes=0;
+			client.updates.clear();
+		}
+
+#ifdef USE_EPOLL
+		// Non-blocking writers
+		// --------------------
+		//
+		// With epoll client sockets are non-blocking and there are no
+		// writer threads. Data sent is flushed by the event loop and
+		// the rest is written when the socket becomes writable.
+
+		// Change epoll events registered for the client connection.
+		// Zero removes the socket from epoll.
+		static void WatchClient(int i,unsigned int events)
+		{
+			ClientData& client=people[i];
+			if(client.watched==events || client.sock==NULL)
+				return;
+
+			epoll_event ev;
+			ev.events=events;
+			ev.data.u64=0;
+			ev.data.u32=i;
+
+			int op=EPOLL_CTL_MOD;
+			if(client.watched==0)
+				op=EPOLL_CTL_ADD;
+			else if(events==0)
+				op=EPOLL_CTL_DEL;
+
+			if(epoll_ctl(epoll_fd,op,SocketFD(client.sock),&ev)!=0)
+				cerr << "ERROR: epoll_ctl failed" << endl;
+			client.watched=events;
+		}
+
+		// Close the socket of the connection and release the slot.
+		static void CloseClient(int i)
+		{
+			WatchClient(i,0);
+			SDLNet_TCP_Close(people[i].sock);
+			people[i].sock=NULL;
+			people[i].input.Clear();
+			ClearOutput(people[i]);
+			ReleaseClient(i);
+		}
+
+		// Send as much buffered data as the socket accepts. If data
+		// remains, wait until the socket is writable. Close the
+		// connection when it is closing and everything is sent.
+		static void Flush(int i)
+		{
+			ClientData& client=people[i];
+			if(client.sock==NULL)
+				return;
+
+			size_t queued=client.output.size(),written=0;
+			bool ok=WriteMessages(SocketFD(client.sock),client.output,client.output_offset,written);
+			client.output_first+=queued-client.output.size();
+			client.output_bytes-=written;
+			if(!ok)
+			{
+				ClearOutput(client);
+				client.writer_pipe=true;
+			}
+
+			if(client.writer_pipe && !client.closed)
+			{
+				client.closed=true;
+				contexts[client.context].events.push_back(Data(Data("close"),Data(i)));
+			}
+
+			if(client.writer_eof && client.output.empty())
+			{
+				CloseClient(i);
+				return;
+			}
+
+			unsigned int events=client.closed ? 0u : (unsigned int)EPOLLIN;
+			if(client.output.size())
+				events|=EPOLLOUT;
+			WatchClient(i,events);
+		}
+
+		// Flush all connections having new data.
+		static void FlushPending()
+		{
+			for(size_t k=0; k<pending_writes.size(); k++)
+			{
+				people[pending_writes[k]].queued=false;
+				Flush(pending_writes[k]);
+			}
+			pending_writes.clear();
+		}
+#endif
+
+		// Deliver the event "slow" when the output of the connection
+		// exceeds its high-water mark. The event is delivered again
+		// after the output has drained to half of the mark.
+		static void CheckHighWater(int i)
+		{
+			ClientData& client=people[i];
+			if(client.high_water==0)
+				return;
+
+			if(client.slow && client.output_bytes < client.high_water/2)
+				client.slow=false;
+			else if(!client.slow && client.output_bytes > client.high_water && !client.closed)
+			{
+				client.slow=true;
+				contexts[client.context].events.push_back(Data(Data("slow"),Data(i)));
+				metrics.Count("net.slow_clients");
+			}
+		}
+
+		// Append a message to the output of the connection. Lock of the
+		// connection must be held.
+		static void Queue(int i,const Message& msg)
+		{
+			Message m=msg.Encoded(people[i].format);
+			metrics.Count("net.messages_out");
+			metrics.Count("net.bytes_out",m.String().length());
+			people[i].output.push_back(m);
+			people[i].output_bytes+=m.String().length();
+			CheckHighWater(i);
+#ifdef USE_EPOLL
+			if(!people[i].queued && !(people[i].watched & EPOLLOUT))
+			{
+				people[i].queued=true;
+				pending_writes.push_back(i);
+			}
+#else
+			if(SDL_SemPost(people[i].wait)!=0)
+				cerr << "ERROR: SemPost failed" << endl;
+#endif
+		}
+
+		// Queue a replaceable update with the given key. If an update
+		// with the same key is still waiting and not partially written,
+		// replace it. If 'drop' is set, drop the update while the
+		// connection is slow. Return false if dropped. Lock of the
+		// connection must be held.
+		static bool QueueUpdate(int i,const string& key,const Message& msg,bool drop)
+		{
+			ClientData& client=people[i];
+
+			CheckHighWater(i);
+			if(drop && client.slow)
+			{
+				metrics.Count("net.updates_dropped");
+				return false;
+			}
+
+			map<string,unsigned long>::iterator u=client.updates.find(key);
+			if(u!=client.updates.end() && u->second >= client.output_first
+			  && (u->second > client.output_first || client.output_offset==0))
+			{
+				Message& old=client.output[u->second-client.output_first];
+				Message m=msg.Encoded(client.format);
+				client.output_bytes+=m.String().length();
+				client.output_bytes-=old.String().length();
+				old=m;
+				metrics.Count("net.updates_coalesced");
+				return true;
+			}
+
+			Queue(i,msg);
+			client.updates[key]=client.output_first+client.output.size()-1;
+
+			return true;
+		}
+
+		// Start closing the connection after the event "close" has been
+		// delivered. Remaining data is still sent.
+		static void FinishClient(int i)
+		{
+			people[i].writer_eof=true;
+#ifdef USE_EPOLL
+			Flush(i);
+#else
+			Unwatch(people[i].sock);
+			closing_clients.push_back(i);
+			if(SDL_SemPost(people[i].wait)!=0)
+				cerr << "ERROR: SemPost failed" << endl;
+#endif
+		}
+
+		// Read at most 'size' bytes from the client connection. Return
+		// the number of bytes read, 0 if nothing is available and -1 if
+		// the connection is closed.
+		static int ReadClient(int i,char* data,int size)
+		{
+#ifdef USE_EPOLL
+			ssize_t len=recv(SocketFD(people[i].sock),data,size,0);
+			if(len < 0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR))
+				return 0;
+
+			return len > 0 ? len : -1;
+#else
+			int len=SDLNet_TCP_Recv(people[i].sock, data, size);
+
+			return len > 0 ? len : -1;
+#endif
 		}
 		
+		// Return the type of a server event for metrics. Messages sent
+		// by the clients are ("Command",arguments) and are named by the
+		// command. Text messages are recognized without parsing them.
+		static string EventType(const Data& event)
+		{
+			if(event[0].IsString())
+				return event[0].String();
+
+			if(event[1].IsList())
+			{
+				const Data& L=event[1];
+				if(L.Size()==0 || !L[0].IsString())
+					return "message.other";
+
+				const string& cmd=L[0].String();
+				if(cmd.length()==0 || cmd.length() > 32)
+					return "message.other";
+				for(size_t i=0; i<cmd.length(); i++)
+					if(!isalnum(cmd[i]) && cmd[i]!='_')
+						return "message.other";
+
+				return "message."+cmd;
+			}
+			if(!event[1].IsString())
+				return "message.other";
+
+			const string& s=event[1].String();
+			if(s.length() < 3 || s[0]!='(' || s[1]!='"')
+				return "message.other";
+
+			size_t i=2;
+			while(i < s.length() && i < 34 && (isalnum(s[i]) || s[i]=='_'))
+				i++;
+			if(i==2 || i==s.length() || s[i]!='"')
+				return "message.other";
+
+			return "message."+s.substr(2,i-2);
+		}
+
+#ifndef USE_EPOLL
 		// Server writer thread
 		static int writer_thread(void *data)
 		{
@@ -98,8 +934,8 @@ namespace Evaluator
 
 			TCPsocket socket;
 			bool eof;
-			string writestr;
-			int len;
+			deque<Message> writing;
+			size_t offset;
 
 			SDL_LockMutex(client.lock);
 //			int number=client.number;
@@ -112,26 +948,46 @@ namespace Evaluator
 			{
 				SDL_SemWait(client.wait);
 				
+				// Take the queued messages and leave an empty queue for new ones.
 				SDL_LockMutex(client.lock);
 				eof=client.writer_eof;
-				writestr=client.write_buffer;
-				client.write_buffer="";
+				writing.swap(client.output);
+				offset=client.output_offset;
+				client.output_offset=0;
+				client.output_first+=writing.size();
 				SDL_UnlockMutex(client.lock);
 
-				if(writestr != "")
+				if(writing.size())
 				{
-//					cout << "Thread " << number << ": send " << writestr << endl;
 					SDL_LockMutex(client.lock);
 					client.writing=true;
 					SDL_UnlockMutex(client.lock);
-					
-					len=SDLNet_TCP_Send(socket, (char *)writestr.c_str(), writestr.length());
+
+					size_t bytes=0;
+					for(size_t k=0; k<writing.size(); k++)
+						bytes+=writing[k].String().length();
+					bytes-=offset;
+
+					bool ok=true;
+#ifdef USE_SOCKET_FD
+					size_t written=0;
+					ok=WriteMessages(SocketFD(socket),writing,offset,written);
+#else
+					for(size_t k=0; k<writing.size() && ok; k++)
+					{
+						const string& s=writing[k].String();
+						ok=SDLNet_TCP_Send(socket, (char *)s.data()+offset, s.length()-offset)==(int)(s.length()-offset);
+						offset=0;
+					}
+#endif
+					writing.clear();
 					
 					SDL_LockMutex(client.lock);
 					client.writing=false;
+					client.output_bytes-=bytes;
 					SDL_UnlockMutex(client.lock);
 
-					if(len != (int)writestr.length())
+					if(!ok)
 					{
 						SDL_LockMutex(client.lock);
 						client.writer_pipe=true;
@@ -144,7 +1000,7 @@ namespace Evaluator
 					SDL_LockMutex(client.lock);
 					SDLNet_TCP_Close(client.sock);
 					client.sock = NULL;
-					client.read_buffer="";
+					client.input.Clear();
 					SDL_UnlockMutex(client.lock);
 					break;
 				}				
@@ -154,6 +1010,7 @@ namespace Evaluator
 			
 			return 0;
 		}
+#endif
 		
 // Library functions
 		/// net_create_server(p) - Initialize server on TCP-port
@@ -161,7 +1018,8 @@ namespace Evaluator
 		/// fails.
 		Data net_create_server(const Data& arg)
 		{
-			if(server_created)
+			ServerContext& context=contexts[current_context];
+			if(context.created)
 				throw LangErr("net_create_server","server already created");
 			if(!arg.IsInteger())
 				throw LangErr("net_create_server","invalid port number");
@@ -169,25 +1027,32 @@ namespace Evaluator
 
 			security.CreateSocket(port);
 			
-			/* Allocate the socket set */
-			socketset = SDLNet_AllocSocketSet(MAX_CONNECTIONS+1);
-			if ( socketset == NULL )
-				throw LangErr("net_create_server","couldn't create socket set");
+			/* Allocate the socket set shared by all server contexts */
+			if ( !ServerInitialized() )
+			{
+#ifdef USE_EPOLL
+				epoll_fd = epoll_create(MAX_CONNECTIONS+MAX_SERVER_CONTEXTS);
+				wake_fd = eventfd(0,EFD_NONBLOCK);
+				if ( epoll_fd < 0 || wake_fd < 0 )
+					throw LangErr("net_create_server","couldn't create epoll instance");
+
+				epoll_event ev;
+				ev.events=EPOLLIN;
+				ev.data.u64=0;
+				ev.data.u32=EPOLL_WAKE_TAG;
+				epoll_ctl(epoll_fd,EPOLL_CTL_ADD,wake_fd,&ev);
+#else
+				ResizeSocketSet(MAX_CONNECTIONS+MAX_SERVER_CONTEXTS);
+#endif
+			}
 			/* Create the server socket */
-			SDLNet_ResolveHost(&serverIP, NULL, port);
-			servsock = SDLNet_TCP_Open(&serverIP);
-			if (servsock == NULL)
+			SDLNet_ResolveHost(&context.serverIP, NULL, port);
+			context.servsock = SDLNet_TCP_Open(&context.serverIP);
+			if (context.servsock == NULL)
 				throw LangErr("net_create_server","couldn't create server socket");
-			SDLNet_TCP_AddSocket(socketset, servsock);
+			Watch(context.servsock,EPOLL_SERVER_TAG+current_context);
 
-			for(size_t i=0; i<MAX_CONNECTIONS; i++)
-			{
-				people[i].lock = SDL_CreateMutex();
-				people[i].wait = SDL_CreateSemaphore(0);
-				people[i].writer_thread = NULL;
-			}
-			
-			server_created=true;
+			context.created=true;
 			
 			return Null;
 		}
@@ -201,7 +1066,7 @@ namespace Evaluator
 			
 			int client=arg.Integer();
 			
-			if(client < 0 || client >=MAX_CONNECTIONS)
+			if(client < 0 || client >= (int)people.size())
 				throw LangErr("net_client_ip","invalid client number");
 
 			SDL_LockMutex(people[client].lock);
@@ -246,7 +1111,7 @@ namespace Evaluator
 				return Null;
 			
 			int client=arg.Integer();
-			if(client < 0 || client >=MAX_CONNECTIONS || people[client].sock==NULL)
+			if(client < 0 || client >= (int)people.size() || people[client].sock==NULL)
 //				throw LangErr("net_client_name","invalid client number");
 				return Null;
 
@@ -260,6 +1125,56 @@ namespace Evaluator
                             return Evaluator::Libnet::net_client_ip(arg);
 		}
 		
+		// Queue complete messages received from the client connection.
+		// Return false if the server sent an invalid frame.
+		static bool ReceiveClientMessages(size_t i)
+		{
+			ReceiveBuffer& input=client_buffer[i];
+			string line;
+			const char* payload;
+			size_t size;
+			bool compressed;
+
+			while(1)
+			{
+				if(client_framed[i])
+				{
+					int ret=input.Frame(payload,size,compressed);
+					if(ret==0)
+						break;
+					if(ret < 0)
+						return false;
+
+					try
+					{
+						event_buffer.push_back(Data(Data(int(i)),DecodeFrame(payload,size,compressed)));
+					}
+					catch(Error::General e)
+					{
+						return false;
+					}
+				}
+				else
+				{
+					if(!input.Line(line))
+						break;
+
+					// Server switches to frames after this line. Confirm
+					// it and switch to frames, too.
+					if(client_format[i]!=FORMAT_TEXT && !client_framed[i] && line==ProtocolLine(client_format[i]))
+					{
+						client_framed[i]=true;
+						string confirm=line+"\n";
+						SDLNet_TCP_Send(connections[i], (char *)confirm.data(), confirm.length());
+						continue;
+					}
+					event_buffer.push_back(Data(Data(int(i)),Data(line)));
+				}
+			}
+
+			return true;
+		}
+
 		/// net_get() - Check if there are data available in some
 		/// client connection.  Return {\tt NULL}, if not. Otherwise,
 		/// return a pair $(n,s)$, where $n$ is the number of the
@@ -286,223 +1201,522 @@ namespace Evaluator
 						}
 						else if(SDLNet_SocketReady(connections[i]))
 						{
-							char data[BUFFER_SIZE+1];
-							int len=SDLNet_TCP_Recv(connections[i], data, BUFFER_SIZE);
+							char* space=client_buffer[i].Space(READ_SIZE);
+							int len=SDLNet_TCP_Recv(connections[i], space, client_buffer[i].SpaceSize());
+
+							if (len <=0)
+							{
+								SDLNet_TCP_DelSocket(client_socketset, connections[i]);
+								SDLNet_TCP_Close(connections[i]);
+								connections[i] = NULL;
+								client_buffer[i].Clear();
+								event_buffer.push_back(Data(Data("close"),Data(int(i))));
+							}
+							else
+							{
+								client_buffer[i].Received(len);
+
+								// Do not buffer an endless line or frame.
+								if(!ReceiveClientMessages(i) || client_buffer[i].Size() > max_input)
+								{
+									SDLNet_TCP_DelSocket(client_socketset, connections[i]);
+									SDLNet_TCP_Close(connections[i]);
+									connections[i] = NULL;
+									client_buffer[i].Clear();
+									event_buffer.push_back(Data(Data("close"),Data(int(i))));
+								}
+							}
+						}
+					}
+			}
+
+			if(event_buffer.size()==0)
+				return Null;
+
+			Data ret=event_buffer.front();
+			event_buffer.pop_front();
+			
+			return ret;
+		}
+		
+		// Accept a new connection to the server context.
+		static void Accept(int c)
+		{
+			ServerContext& context=contexts[c];
+			TCPsocket newsock;
+			newsock = SDLNet_TCP_Accept(context.servsock);
+			if (newsock == NULL)
+				throw LangErr("net_server_get","accept failed");
+					
+			/* Take a free slot or refuse the connection */
+			int which=AllocateClient();
+			if(which < 0)
+			{
+				cerr << "Warning: connection limit " << max_connections << " reached" << endl;
+				SDLNet_TCP_Close(newsock);
+				metrics.Count("net.connections_refused");
+				return;
+			}
+
+			/* Initialize structures for new connection */
+			SDL_LockMutex(people[which].lock);
+			people[which].number = which;
+			people[which].sock = newsock;
+			people[which].peer = *SDLNet_TCP_GetPeerAddress(newsock);
+			people[which].output.clear();
+			people[which].output_offset=0;
+			people[which].output_bytes=0;
+			people[which].output_first=0;
+			people[which].updates.clear();
+			people[which].high_water=default_high_water;
+			people[which].slow=false;
+			people[which].input.Clear();
+			people[which].writing=false;
+			people[which].writer_eof=false;
+			people[which].writer_pipe=false;
+			people[which].closed=false;
+			people[which].format=FORMAT_TEXT;
+			people[which].framed=false;
+			people[which].context=c;
+#ifdef USE_EPOLL
+			people[which].watched=0;
+			people[which].queued=false;
+			int fd=SocketFD(newsock);
+			if(fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK)!=0)
+			{
+				cout << "ERROR: Cannot make socket non-blocking" << endl;
+				SDLNet_TCP_Close(people[which].sock);
+				people[which].sock = NULL;
+			}
+#else
+			if(people[which].writer_thread)
+				SDL_WaitThread(people[which].writer_thread,0);
+			people[which].writer_thread=SDL_CreateThread(writer_thread,&people[which]);
+			if(people[which].writer_thread==NULL)
+			{
+				cout << "ERROR: Cannot create thread" << endl;
+				SDLNet_TCP_Close(people[which].sock);
+				people[which].sock = NULL;
+			}
+#endif
+			if(people[which].sock!=NULL)
+			{
+#ifdef USE_EPOLL
+				WatchClient(which,EPOLLIN);
+#else
+				Watch(people[which].sock,which);
+#endif
+				context.events.push_back(Data(Data("open"),Data(which)));
+				metrics.Count("net.connections_opened");
+				metrics.AddGauge("net.connections",1);
+			}
+			else
+				ReleaseClient(which);
+			SDL_UnlockMutex(people[which].lock);
+		}
+
+		// Queue complete messages received from the connection to its
+		// server context. Return false if the connection sent an
+		// invalid frame.
+		static bool ReceiveMessages(int i)
+		{
+			ClientData& client=people[i];
+			list<Data>& events=contexts[client.context].events;
+			string line;
+			const char* payload;
+			size_t size;
+			bool compressed;
+
+			while(1)
+			{
+				if(client.framed)
+				{
+					int ret=client.input.Frame(payload,size,compressed);
+					if(ret==0)
+						break;
+					if(ret < 0)
+						return false;
+
+					try
+					{
+						events.push_back(Data(Data(i),DecodeFrame(payload,size,compressed)));
+					}
+					catch(Error::General e)
+					{
+						return false;
+					}
+				}
+				else
+				{
+					if(!client.input.Line(line))
+						break;
+
+					if(client.format==FORMAT_TEXT && (line==PROTOCOL_BINARY || line==PROTOCOL_COMPRESSED))
+					{
+						Queue(i,Message::Line(line));
+						client.format=(line==PROTOCOL_BINARY ? FORMAT_BINARY : FORMAT_COMPRESSED);
+						metrics.Count(line==PROTOCOL_BINARY ? "net.binary_connections" : "net.compressed_connections");
+						continue;
+					}
+					// Client sends frames after repeating the line.
+					if(client.format!=FORMAT_TEXT && line==ProtocolLine(client.format))
+					{
+						client.framed=true;
+						continue;
+					}
+					events.push_back(Data(Data(i),Data(line)));
+				}
+				metrics.Count("net.messages_in");
+			}
+
+			return true;
+		}
+
+		// Read available data of the client connection and queue
+		// events to the server context owning the connection.
+		static void Receive(int i)
+		{
+			SDL_LockMutex(people[i].lock);
+
+			if(people[i].sock && !people[i].closed)
+			{
+				ServerContext& context=contexts[people[i].context];
+
+				ReceiveBuffer& input=people[i].input;
+				char* space=input.Space(READ_SIZE);
+				int len=ReadClient(i, space, input.SpaceSize());
+
+				if (len < 0)
+				{
+					if(!input.Empty() && !people[i].framed)
+						context.events.push_back(Data(Data(i),Data(input.Rest())));
+					people[i].closed=true;
+					context.events.push_back(Data(Data("close"),Data(i)));
+				}
+				else
+				{
+					input.Received(len);
+					metrics.Count("net.bytes_in",len);
+
+					if(!ReceiveMessages(i))
+					{
+						cerr << "Warning: invalid frame from client " << i << endl;
+						metrics.Count("net.invalid_frames");
+						people[i].closed=true;
+						context.events.push_back(Data(Data("close"),Data(i)));
+					}
+					else if(input.Size() > max_input)
+					{
+						// Do not buffer an endless line or frame.
+						cerr << "Warning: too long message from client " << i << endl;
+						metrics.Count("net.oversized_messages");
+						input.Clear();
+						people[i].closed=true;
+						context.events.push_back(Data(Data("close"),Data(i)));
+					}
+				}
+			}
+#ifdef USE_EPOLL
+			// Stop reports of a closing socket, since it is not read anymore.
+			else if(people[i].sock)
+				WatchClient(i,people[i].watched & ~EPOLLIN);
+#endif
+
+			if(people[i].sock && people[i].writer_pipe && !people[i].closed)
+			{
+				people[i].closed=true;
+				contexts[people[i].context].events.push_back(Data(Data("close"),Data(i)));
+			}
+
+			SDL_UnlockMutex(people[i].lock);
+		}
+
+		// Wait at most 'ms' milliseconds (forever if negative) for
+		// network activity and queue the resulting events to the
+		// server contexts. Return true if something happened.
+		static bool PollSockets(int ms)
+		{
+#ifdef USE_EPOLL
+			epoll_event ev[EPOLL_EVENTS];
+
+			FlushPending();
+
+			int n=epoll_wait(epoll_fd, ev, EPOLL_EVENTS, ms);
+			if(n < 0)
+			{
+				if(errno==EINTR)
+					return false;
+				throw LangErr("net_server_get","epoll_wait failed");
+			}
+
+			for(int k=0; k<n; k++)
+			{
+				unsigned int tag=ev[k].data.u32;
+
+				if(tag==EPOLL_WAKE_TAG)
+				{
+					uint64_t count;
+					ssize_t ret=read(wake_fd,&count,sizeof(count));
+					(void)ret;
+				}
+				else if(tag & EPOLL_SERVER_TAG)
+				{
+					int c=tag-EPOLL_SERVER_TAG;
+					if(contexts[c].created)
+						Accept(c);
+				}
+				else
+				{
+					if(ev[k].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+						Flush(tag);
+					if(ev[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+						Receive(tag);
+				}
+			}
+
+			return n > 0;
+#else
+			if(SDLNet_CheckSockets(socketset, ms < 0 ? ~0 : ms) < 1)
+				return false;
+
+			/* Check for new connections */
+			for(int c=0; c<server_contexts; c++)
+				if ( contexts[c].created && SDLNet_SocketReady(contexts[c].servsock) )
+					Accept(c);
+
+			/* Check for events on existing clients */
+			for (size_t k=0; k<active_clients.size(); k++)
+			{
+				int i=active_clients[k];
+				SDL_LockMutex(people[i].lock);
+				bool ready=people[i].sock && !people[i].writing && SDLNet_SocketReady(people[i].sock);
+				bool pipe=people[i].sock && people[i].writer_pipe;
+				SDL_UnlockMutex(people[i].lock);
+
+				if(ready || pipe)
+					Receive(i);
+			}
+
+			return true;
+#endif
+		}
+
+		// Record the total and the largest output waiting for sending.
+		static void RecordQueueMetrics()
+		{
+			size_t total=0,largest=0;
+
+			for(size_t k=0; k<active_clients.size(); k++)
+			{
+				ClientData& client=people[active_clients[k]];
+				SDL_LockMutex(client.lock);
+				size_t bytes=client.output_bytes;
+				SDL_UnlockMutex(client.lock);
+
+				total+=bytes;
+				if(bytes > largest)
+					largest=bytes;
+			}
+
+			metrics.Gauge("net.bytes_queued",total);
+			metrics.Gauge("net.bytes_queued_largest",largest);
+			queue_metrics_time=Metrics::Now();
+		}
+
+		// Wait until the current server context has events or 'timeout'
+		// milliseconds have passed. Negative 'timeout' waits forever.
+		static ServerContext& WaitServerEvents(const char* fn,int timeout)
+		{
+			ServerContext& context=contexts[current_context];
+			if(!context.created)
+				throw LangErr(fn,"server not created");
+
+			// Time spent by the script handling the previous events.
+			if(context.last_event!="")
+			{
+				metrics.Time("handler."+context.last_event,Metrics::Now()-context.last_event_time);
+				context.last_event="";
+			}
+			metrics.Tick();
+#ifdef USE_EPOLL
+			FlushPending();
+#endif
+			if(metrics.Enabled() && Metrics::Now() >= queue_metrics_time+1.0)
+				RecordQueueMetrics();
+
+			double deadline=Metrics::Now()+timeout/1000.0;
+
+			while(context.events.size()==0)
+			{
+				if(Evaluator::quitsignal)
+				{
+					context.events.push_back(Data(Data("quit"),Null));
+					break;
+				}
+
+				int wait=-1;
+				if(server_polling)
+					wait=0;
+				else if(timeout >= 0)
+				{
+					wait=int((deadline-Metrics::Now())*1000.0+0.999);
+					if(wait < 0)
+						wait=0;
+				}
+#ifndef USE_EPOLL
+				// Signals do not interrupt SDLNet_CheckSockets(), so wait in slices.
+				if(wait < 0 || wait > 500)
+					wait=500;
+#endif
+				PollSockets(wait);
+
+				// Look only once for events when polling many contexts.
+				if(server_polling || (timeout >= 0 && Metrics::Now() >= deadline))
+					break;
+			}
+
+			return context;
+		}
+
+		// Finish a connection whose "close" event has been returned.
+		static void FinishClosed(int con)
+		{
+			SDL_LockMutex(people[con].lock);
+			FinishClient(con);
+			SDL_UnlockMutex(people[con].lock);
+			metrics.AddGauge("net.connections",-1);
+		}
+
+		// Finish connections closed in the previous batch of events.
+		static void FinishBatch(ServerContext& context)
+		{
+			for(size_t i=0; i<context.finishing.size(); i++)
+				FinishClosed(context.finishing[i]);
+			context.finishing.clear();
+		}
+
+		// Remove the first event of the context and return it. If
+		// 'defer' is set, the connection of a "close" event is kept
+		// until the next call, so that replies to its earlier events
+		// in the same batch are still accepted.
+		static Data TakeServerEvent(ServerContext& context,bool defer)
+		{
+			Data ret=context.events.front();
+			context.events.pop_front();
 
-							if (len <=0)
-							{
-								SDLNet_TCP_DelSocket(client_socketset, connections[i]);
-								SDLNet_TCP_Close(connections[i]);
-								connections[i] = NULL;
-								event_buffer.push_back(Data(Data("close"),Data(int(i))));
-							}
-							else
-							{
-								if(len>=BUFFER_SIZE)
-									throw LangErr("net_get","buffer overflow");
+			// Handle "close" event.
+			if(ret[0].IsString() && ret[0].String()=="close")
+			{
+				int con=ret[1].Integer();
 
-								// Scan data and split it at each null-character.
-								for(int j=0; j<len; j++)
-								{
-									if(data[j]=='\n')
-									{
-										event_buffer.push_back(Data(Data(int(i)),Data(client_buffer[i])));
-										client_buffer[i]="";									
-									}
-									else if(data[j]!='\r')
-										client_buffer[i]+=data[j];
-								}
-							}
-						}
-					}
+				if(defer)
+					context.finishing.push_back(con);
+				else
+					FinishClosed(con);
 			}
 
-			if(event_buffer.size()==0)
-				return Null;
-
-			Data ret=event_buffer.front();
-			event_buffer.pop_front();
-			
 			return ret;
 		}
-		
+
+		// Parse the time out argument of net_server_get functions.
+		static int ServerTimeout(const char* fn,const Data& arg)
+		{
+			if(arg.IsNull())
+				return -1;
+			if(!arg.IsInteger())
+				throw LangErr(fn,"invalid arguments "+tostr(arg).String());
+
+			return arg.Integer() > 0 ? arg.Integer() : 0;
+		}
+
 		/// net_server_get(t) - Wait for network events. If a client
 		/// connects to the server, return a pair \{\tt("open",$n$)\} where
 		/// $n$ is is a client number. Whenever a client disconnects,
 		/// return a pair \{\tt ("close",$n$)\} respectively. Special event
 		/// \{\tt ("quit",NULL)\} is returned when the server process is
-		/// interrupted by the signal. If the client
+		/// interrupted by the signal. Event \{\tt ("slow",$n$)\} tells
+		/// that the client $n$ has fallen behind, see {\tt
+		/// net_server_high_water()}. If the client
 		/// number $n$ sends data, return a pair $(n,s)$ where $s$ is
 		/// a string containing data sent. Throw an exception if
 		/// network error occurs. Parameter $t$ defines time out for
 		/// listening process. If $t$ is {\tt NULL}, then the function
 		/// does not return until there is an event available. If $t$
 		/// is positive integer, process waits for $t$ms and
-		/// returns {\tt NULL} if there are no events available.
+		/// returns {\tt NULL} if there are no events available. When
+		/// the server process hosts several tables, the function never
+		/// waits regardless of $t$ but checks the network once and
+		/// returns {\tt NULL} if there are no events, so that the other
+		/// tables get their turn. The {\tt "main"} trigger of such a
+		/// server must return after handling the events available.
 		Data net_server_get(const Data& arg)
 		{
-			bool done=false;
-			Uint32 timeleft,timeout=0;
-			
-			if(arg.IsNull())
-				timeout=(~0);
-			else if(arg.IsInteger())
-				timeout=arg.Integer() > 0 ? arg.Integer() : 0;
-			else
-				throw LangErr("net_server_get","invalid arguments "+tostr(arg).String());
-			
-			if(!server_created)
-				throw LangErr("net_server_get","server not created");
-
-			while(server_event_buffer.size()==0)
-			{
-				/* Check for events */
-				timeleft=timeout;
+			int timeout=ServerTimeout("net_server_get",arg);
+			FinishBatch(contexts[current_context]);
+			ServerContext& context=WaitServerEvents("net_server_get",timeout);
 
-				while(!done)
-				{
-					if(Evaluator::quitsignal)
-					{
-						server_event_buffer.push_back(Data(Data("quit"),Null));
-						done=true;
-					}
-					else if(SDLNet_CheckSockets(socketset, 500)>=1)
-						break;
+			/* Take return value from event queue. */
+			Data ret;
 
-					if(timeleft <= 500)
-						done=true;
-					else if(timeleft!=Uint32(~0))
-						timeleft-=500;					
-				}
+			if(context.events.size())
+			{
+				ret=TakeServerEvent(context,false);
 
-				if(done)
-					break;
-				
-				/* Check for new connections */
-				if ( SDLNet_SocketReady(servsock) )
+				if(metrics.Enabled())
 				{
-					TCPsocket newsock;
-					newsock = SDLNet_TCP_Accept(servsock);
-					if (newsock == NULL)
-						throw LangErr("net_server_get","accept failed");
-					
-					/* Look for unconnected person slot */
-					int which;
-					bool isfree;
-					for (which=0; which<MAX_CONNECTIONS; ++which )
-					{
-						SDL_LockMutex(people[which].lock);
-						isfree=!people[which].sock;
-						SDL_UnlockMutex(people[which].lock);
-						
-						if (isfree)
-							break;
-					}
-					if(which >= MAX_CONNECTIONS)
-						throw LangErr("net_server_get","too many connections");
-
-					/* Initialize structures for new connection */
-					SDL_LockMutex(people[which].lock);
-					people[which].number = which;
-					people[which].sock = newsock;
-					people[which].peer = *SDLNet_TCP_GetPeerAddress(newsock);
-					people[which].write_buffer="";
-					people[which].read_buffer="";
-					people[which].writing=false;
-					people[which].writer_eof=false;
-					people[which].writer_pipe=false;
-					people[which].closed=false;
-					if(people[which].writer_thread)
-						SDL_WaitThread(people[which].writer_thread,0);
-					people[which].writer_thread=SDL_CreateThread(writer_thread,&people[which]);
-					if(people[which].writer_thread==NULL)
-					{
-						cout << "ERROR: Cannot create thread" << endl;
-						SDLNet_TCP_Close(people[which].sock);
-						people[which].sock = NULL;
-					}
-					else
-					{
-						SDLNet_TCP_AddSocket(socketset, people[which].sock);
-						server_event_buffer.push_back(Data(Data("open"),Data(which)));
-					}
-					SDL_UnlockMutex(people[which].lock);
+					context.last_event=EventType(ret);
+					context.last_event_time=Metrics::Now();
 				}
+			}
+			metrics.Gauge("net.event_queue",context.events.size());
+			
+			return ret;
+		}
 
-				/* Check for events on existing clients */
-				for (int i=0; i<MAX_CONNECTIONS; i++)
-				{
-					SDL_LockMutex(people[i].lock);
-
-					if(people[i].sock)
-					{						
-						if (!people[i].writing && SDLNet_SocketReady(people[i].sock))
-						{
-							char data[BUFFER_SIZE+1];
-							int len=SDLNet_TCP_Recv(people[i].sock, data, BUFFER_SIZE);
-
-							if (len <=0)
-							{
-								if(people[i].read_buffer != "")
-									server_event_buffer.push_back(Data(Data(i),Data(people[i].read_buffer)));
-								people[i].closed=true;
-								server_event_buffer.push_back(Data(Data("close"),Data(i)));
-							}
-							else
-							{
-								if(len>=BUFFER_SIZE)
-									throw LangErr("net_server_get","buffer overflow");
-
-								// Scan data and split it at each null-character.
-								for(int j=0; j<len; j++)
-								{
-									if(data[j]=='\n')
-									{
-										server_event_buffer.push_back(Data(Data(i),Data(people[i].read_buffer)));
-										people[i].read_buffer="";
-									}
-									else if(data[j]!='\r')
-										people[i].read_buffer+=data[j];
-								}
-							}
-						
-						}
+		/// net_server_get_all(t,m) - Wait for network events like
+		/// {\tt net_server_get($t$)}, but return a list of all events
+		/// available, at most $m$ of them if $m$ is given. The list is
+		/// empty if no event arrived before the time out or, when the
+		/// server process hosts several tables, if no event was
+		/// available at the moment of the call. A client
+		/// closed by a {\tt ("close",$n$)} event of the list is freed
+		/// on the next call, so that messages sent to it before that
+		/// are silently dropped.
+		Data net_server_get_all(const Data& arg)
+		{
+			Data t=arg;
+			size_t max_events=0;
 
-						if(people[i].writer_pipe)
-						{
-							people[i].closed=true;
-							server_event_buffer.push_back(Data(Data("close"),Data(i)));
-						}
-						
-					} // if(people[i].sock)
+			if(arg.IsList(2))
+			{
+				if(!arg[1].IsInteger() || arg[1].Integer() < 1)
+					ArgumentError("net_server_get_all",arg);
+				t=arg[0];
+				max_events=arg[1].Integer();
+			}
 
-					SDL_UnlockMutex(people[i].lock);
+			int timeout=ServerTimeout("net_server_get_all",t);
+			FinishBatch(contexts[current_context]);
+			ServerContext& context=WaitServerEvents("net_server_get_all",timeout);
 
-				} // for (int i=0; i<MAX_CONNECTIONS; i++)
-			}
+			size_t n=context.events.size();
+			if(max_events && n > max_events)
+				n=max_events;
 
-			/* Take return value from event queue. */
 			Data ret;
+			ret.MakeList(n);
+			for(size_t i=0; i<n; i++)
+				ret[i]=TakeServerEvent(context,true);
 
-			if(server_event_buffer.size())
+			if(n && metrics.Enabled())
 			{
-				ret=server_event_buffer.front();
-				server_event_buffer.pop_front();
-
-				// Handle "close" event.
-				if(ret[0].IsString() && ret[0].String()=="close")
-				{
-					int con=ret[1].Integer();
-
-					SDL_LockMutex(people[con].lock);
-					SDLNet_TCP_DelSocket(socketset, people[con].sock);
-					people[con].writer_eof=true;
-					if(SDL_SemPost(people[con].wait)!=0)
-						cerr << "ERROR: SemPost failed" << endl;
-					SDL_UnlockMutex(people[con].lock);
-				}
+				context.last_event="batch";
+				context.last_event_time=Metrics::Now();
+				metrics.Count("net.event_batches");
+				metrics.Count("net.events_batched",n);
 			}
-			
+			metrics.Gauge("net.event_queue",context.events.size());
+
 			return ret;
 		}
 
@@ -544,11 +1758,17 @@ namespace Evaluator
 			if(con==-1)
 			{
 				connections.push_back(tcpsock);
+				client_buffer.resize(connections.size());
+				client_format.resize(connections.size(),FORMAT_TEXT);
+				client_framed.resize(connections.size(),false);
 				return int(connections.size()-1);
 			}
 			else
 			{
 				connections[con]=tcpsock;
+				client_buffer[con].Clear();
+				client_format[con]=FORMAT_TEXT;
+				client_framed[con]=false;
 				return con;
 			}
 		}
@@ -558,8 +1778,6 @@ namespace Evaluator
 		/// number $n$. Return 1 if successful and 0 on SIGPIPE.
 		Data net_send(const Data& arg)
 		{
-			static char null_char[1]={'\n'};
-
 			if(!arg.IsList(2) || !arg[0].IsInteger())
 				throw LangErr("net_send","invalid arguments "+tostr(arg).String());
 
@@ -569,14 +1787,74 @@ namespace Evaluator
 			if(connections[client]==NULL)
 				throw LangErr("net_send","socket is closed");			
 
-			string data=tostr(arg[1]).String();
+			// Messages are sent as text until the server has acknowledged the format.
+			string data;
+			if(!client_framed[client])
+			{
+				data=tostr(arg[1]).String();
+				data+='\n';
+			}
+			else
+			{
+				AppendFrame(data,arg[1]);
+				string packed;
+				if(client_format[client]==FORMAT_COMPRESSED && CompressFrame(data,packed))
+					data.swap(packed);
+			}
 
-			SDLNet_TCP_Send(connections[client], (char *)data.c_str(), data.length());
-			SDLNet_TCP_Send(connections[client], &null_char, 1);
+			SDLNet_TCP_Send(connections[client], (char *)data.data(), data.length());
 
 			return 1;
 		}
 
+		/// net_protocol(n,p) - Select the protocol of the client
+		/// connection $n$. Protocol {\tt "text"} sends each message
+		/// as a line of text and is the default. Protocol {\tt
+		/// "binary"} sends messages as length-prefixed frames of
+		/// binary data, which are much faster to convert for large
+		/// values. Protocol {\tt "compressed"} also compresses
+		/// frames of at least 1024 bytes, which saves bandwidth for
+		/// large replies. The server must support the protocol.
+		/// Messages received are the same in all protocols, except
+		/// that values other than strings are not converted to text.
+		/// Messages are sent as text until the server has acknowledged
+		/// the protocol, which is read by {\tt net_get()}. Protocol
+		/// can be selected only once.
+		Data net_protocol(const Data& arg)
+		{
+			if(!arg.IsList(2) || !arg[0].IsInteger() || !arg[1].IsString())
+				ArgumentError("net_protocol",arg);
+
+			int client=arg[0].Integer();
+			if(client < 0 || (size_t) client >=connections.size())
+				throw LangErr("net_protocol","invalid client number");
+			if(connections[client]==NULL)
+				throw LangErr("net_protocol","socket is closed");
+
+			string protocol=arg[1].String();
+			int format;
+			if(protocol=="text")
+				format=FORMAT_TEXT;
+			else if(protocol=="binary")
+				format=FORMAT_BINARY;
+			else if(protocol=="compressed")
+				format=FORMAT_COMPRESSED;
+			else
+				throw LangErr("net_protocol","unknown protocol "+protocol);
+
+			if(format==client_format[client])
+				return Null;
+			if(client_format[client]!=FORMAT_TEXT || format==FORMAT_TEXT)
+				throw LangErr("net_protocol","protocol already selected");
+
+			string line=ProtocolLine(format);
+			line+='\n';
+			SDLNet_TCP_Send(connections[client], (char *)line.data(), line.length());
+			client_format[client]=format;
+
+			return Null;
+		}
+
 		/// net_server_isopen(n) - Check if server's connection number
 		/// $n$ is open. Return NULL if invalid connection number.
 		Data net_server_isopen(const Data& arg)
@@ -586,7 +1864,7 @@ namespace Evaluator
 				return Null;
 
 			int client=arg.Integer();
-			if(client < 0 || client >=MAX_CONNECTIONS)
+			if(client < 0 || client >= (int)people.size())
 //				throw LangErr("net_server_isopen","invalid client number");
 				return Null;
 
@@ -620,7 +1898,7 @@ namespace Evaluator
 				throw LangErr("net_server_send","invalid arguments "+tostr(arg).String());
 
 			int client=arg[0].Integer();
-			if(client < 0 || client >=MAX_CONNECTIONS)
+			if(client < 0 || client >= (int)people.size())
 				throw LangErr("net_server_send","invalid client number");
 
 			SDL_LockMutex(people[client].lock);
@@ -630,15 +1908,11 @@ namespace Evaluator
 			if(!socket_open)
 				throw LangErr("net_server_send","socket is closed");
 				
-			string data=tostr(arg[1]).String();
+			Message msg(arg[1]);
 
 			SDL_LockMutex(people[client].lock);
 			if(!people[client].closed)
-			{
-				people[client].write_buffer+=data+"\n";
-				if(SDL_SemPost(people[client].wait)!=0)
-					cerr << "ERROR: SemPost failed" << endl;
-			}
+				Queue(client,msg);
 			SDL_UnlockMutex(people[client].lock);
 						
 			return 1;
@@ -653,7 +1927,7 @@ namespace Evaluator
 				return Null;
 			
 			int client=arg.Integer();
- 			if(client < 0 || client >=MAX_CONNECTIONS)
+ 			if(client < 0 || client >= (int)people.size())
 // 				throw LangErr("net_server_close","invalid client number");
 				return Null;
 
@@ -666,10 +1940,14 @@ namespace Evaluator
 				return Null;
 
 			SDL_LockMutex(people[client].lock);
+			bool was_closed=people[client].closed;
 			people[client].closed=true;
 			SDL_UnlockMutex(people[client].lock);
+
+			if(was_closed)
+				return Null;
 			
-			server_event_buffer.push_back(Data(Data("close"),Data(client)));
+			contexts[people[client].context].events.push_back(Data(Data("close"),Data(client)));
 
 			return Null;
 		}
@@ -689,6 +1967,7 @@ namespace Evaluator
 			SDLNet_TCP_DelSocket(client_socketset, connections[c]);
 			SDLNet_TCP_Close(connections[c]);
 			connections[c]=NULL;
+			client_buffer[c].Clear();
 
 			return Null;
 		}
@@ -697,31 +1976,349 @@ namespace Evaluator
 		/// clients.
 		Data net_server_send_all(const Data& arg)
 		{
-			string data=tostr(arg).String();
+			Message msg(arg);
 
-			for(int i=0; i<MAX_CONNECTIONS; i++)
+			for(size_t k=0; k<active_clients.size(); k++)
 			{
+				int i=active_clients[k];
 				SDL_LockMutex(people[i].lock);
-				if(people[i].sock != NULL && !people[i].closed)
-				{
-					people[i].write_buffer+=data+"\n";
-					if(SDL_SemPost(people[i].wait)!=0)
-						cerr << "ERROR: SemPost failed" << endl;
-				}
+				if(people[i].sock != NULL && !people[i].closed && people[i].context==current_context)
+					Queue(i,msg);
 				SDL_UnlockMutex(people[i].lock);
 			}
 			
 			return Null;
 		}
 		
+		/// net_server_multicast(L,s) - Send a string $s$ to each
+		/// client number in the list $L$. The value is serialized
+		/// once and shared by all recipients. Closed connections are
+		/// skipped. Return the number of clients the message was
+		/// queued for.
+		Data net_server_multicast(const Data& arg)
+		{
+			if(!arg.IsList(2) || !arg[0].IsList())
+				ArgumentError("net_server_multicast",arg);
+
+			const Data& L=arg[0];
+			for(size_t i=0; i<L.Size(); i++)
+				if(!L[i].IsInteger() || L[i].Integer() < 0 || L[i].Integer() >= (int)people.size())
+					throw LangErr("net_server_multicast","invalid client number "+tostr(L[i]).String());
+
+			Message msg(arg[1]);
+			int count=0;
+
+			for(size_t i=0; i<L.Size(); i++)
+			{
+				int client=L[i].Integer();
+
+				SDL_LockMutex(people[client].lock);
+				if(people[client].sock != NULL && !people[client].closed)
+				{
+					Queue(client,msg);
+					count++;
+				}
+				SDL_UnlockMutex(people[client].lock);
+			}
+
+			return count;
+		}
+		
+		/// net_server_send_many(L) - Send messages listed in $L$ as
+		/// pairs $(n,s)$ of a client number $n$ and a string $s$. Pairs
+		/// for closed connections are skipped. Return the number of
+		/// messages queued.
+		Data net_server_send_many(const Data& arg)
+		{
+			if(arg.IsNull())
+				return 0;
+			if(!arg.IsList())
+				ArgumentError("net_server_send_many",arg);
+
+			for(size_t i=0; i<arg.Size(); i++)
+				if(!arg[i].IsList(2) || !arg[i][0].IsInteger() || arg[i][0].Integer() < 0 || arg[i][0].Integer() >= (int)people.size())
+					throw LangErr("net_server_send_many","invalid message "+tostr(arg[i]).String());
+
+			int count=0;
+
+			for(size_t i=0; i<arg.Size(); i++)
+			{
+				int client=arg[i][0].Integer();
+				Message msg(arg[i][1]);
+
+				SDL_LockMutex(people[client].lock);
+				if(people[client].sock != NULL && !people[client].closed)
+				{
+					Queue(client,msg);
+					count++;
+				}
+				SDL_UnlockMutex(people[client].lock);
+			}
+
+			return count;
+		}
+
+		/// net_server_max_connections(n) - Allow at most $n$
+		/// simultaneous client connections in all servers of the
+		/// process and return the previous limit. Connections
+		/// exceeding the limit are refused. If $n$ is {\tt NULL},
+		/// return the current limit. Default limit is 1024.
+		Data net_server_max_connections(const Data& arg)
+		{
+			int previous=max_connections;
+
+			if(arg.IsInteger())
+				SetMaxConnections(arg.Integer());
+			else if(!arg.IsNull())
+				ArgumentError("net_server_max_connections",arg);
+
+			return previous;
+		}
+
+		/// net_server_update(n,k,s,p) - Send $s$ to the client number
+		/// $n$ as an update of the state named by the string $k$. If
+		/// an earlier update with the same name is still waiting for
+		/// sending, it is replaced by $s$. If the policy $p$ is {\tt
+		/// "drop"}, the update is not sent at all while the client is
+		/// slow, i.e. its output exceeds the high-water mark. Policy
+		/// {\tt "coalesce"} is the default and only replaces waiting
+		/// updates. Return 1 if the update was queued and 0 if it
+		/// was dropped.
+		Data net_server_update(const Data& arg)
+		{
+			if(!(arg.IsList(3) || arg.IsList(4)) || !arg[0].IsInteger() || !arg[1].IsString())
+				ArgumentError("net_server_update",arg);
+
+			bool drop=false;
+			if(arg.IsList(4))
+			{
+				if(!arg[3].IsString() || (arg[3].String()!="drop" && arg[3].String()!="coalesce"))
+					throw LangErr("net_server_update","invalid policy "+tostr(arg[3]).String());
+				drop=(arg[3].String()=="drop");
+			}
+
+			int client=arg[0].Integer();
+			if(client < 0 || client >= (int)people.size())
+				throw LangErr("net_server_update","invalid client number");
+
+			Message msg(arg[2]);
+			bool queued=false;
+
+			SDL_LockMutex(people[client].lock);
+			if(people[client].sock==NULL)
+			{
+				SDL_UnlockMutex(people[client].lock);
+				throw LangErr("net_server_update","socket is closed");
+			}
+			if(!people[client].closed)
+				queued=QueueUpdate(client,arg[1].String(),msg,drop);
+			SDL_UnlockMutex(people[client].lock);
+
+			return int(queued);
+		}
+
+		/// net_server_queued(n) - Return the number of bytes waiting
+		/// for sending to the client number $n$ or NULL if the
+		/// connection is not open.
+		Data net_server_queued(const Data& arg)
+		{
+			if(!arg.IsInteger())
+				ArgumentError("net_server_queued",arg);
+
+			int client=arg.Integer();
+			if(client < 0 || client >= (int)people.size())
+				return Null;
+
+			SDL_LockMutex(people[client].lock);
+			bool open=people[client].sock!=NULL;
+			size_t bytes=people[client].output_bytes;
+			SDL_UnlockMutex(people[client].lock);
+
+			if(!open)
+				return Null;
+
+			return int(bytes);
+		}
+
+		/// net_server_high_water(n,b) - Set the high-water mark of
+		/// the client number $n$ to $b$ bytes and return the previous
+		/// mark. When more data than the mark waits for sending to
+		/// the client, event {\tt ("slow",$n$)} is delivered once. It
+		/// is delivered again after the client has received half of
+		/// the data. Mark 0 means no limit. With a single argument
+		/// $b$, set the mark of new connections, which is 0 by default.
+		Data net_server_high_water(const Data& arg)
+		{
+			if(arg.IsInteger())
+			{
+				if(arg.Integer() < 0)
+					ArgumentError("net_server_high_water",arg);
+
+				int previous=int(default_high_water);
+				default_high_water=arg.Integer();
+				return previous;
+			}
+
+			if(!arg.IsList(2) || !arg[0].IsInteger() || !arg[1].IsInteger() || arg[1].Integer() < 0)
+				ArgumentError("net_server_high_water",arg);
+
+			int client=arg[0].Integer();
+			if(client < 0 || client >= (int)people.size())
+				throw LangErr("net_server_high_water","invalid client number");
+
+			SDL_LockMutex(people[client].lock);
+			int previous=int(people[client].high_water);
+			people[client].high_water=arg[1].Integer();
+			SDL_UnlockMutex(people[client].lock);
+
+			return previous;
+		}
+
+// Server contexts
+
+		void SetDefaultHighWater(size_t bytes)
+		{
+			default_high_water=bytes;
+		}
+
+		void SetFrameMax(size_t bytes)
+		{
+			if(bytes < 1 || bytes >= FRAME_COMPRESSED)
+				throw LangErr("SetFrameMax","invalid frame limit");
+
+			frame_max=bytes;
+		}
+
+		void SetMaxInput(size_t bytes)
+		{
+			if(bytes < 1)
+				throw LangErr("SetMaxInput","invalid input limit");
+
+			max_input=bytes;
+		}
+
+		void SetMaxConnections(int n)
+		{
+			if(n < 1)
+				throw LangErr("SetMaxConnections","invalid connection limit");
+
+			max_connections=n;
+#if !defined(WIN32)
+			// Each connection needs a file descriptor, so raise the soft limit if possible.
+			rlim_t need=rlim_t(n)+MAX_SERVER_CONTEXTS+64;
+			rlimit limit;
+			if(getrlimit(RLIMIT_NOFILE,&limit)==0 && limit.rlim_cur!=RLIM_INFINITY && limit.rlim_cur < need)
+			{
+				limit.rlim_cur=(limit.rlim_max==RLIM_INFINITY || limit.rlim_max > need) ? need : limit.rlim_max;
+				setrlimit(RLIMIT_NOFILE,&limit);
+			}
+#endif
+		}
+
+		int CreateServerContext()
+		{
+			if(server_contexts >= MAX_SERVER_CONTEXTS)
+				throw LangErr("CreateServerContext","too many server contexts");
+
+			return server_contexts++;
+		}
+
+		void SelectServerContext(int context)
+		{
+			if(context < 0 || context >= server_contexts)
+				throw LangErr("SelectServerContext","invalid server context");
+
+			current_context=context;
+		}
+
+		void CloseServerContext(int context)
+		{
+			if(context < 0 || context >= server_contexts)
+				throw LangErr("CloseServerContext","invalid server context");
+
+			ServerContext& C=contexts[context];
+			if(!C.created)
+				return;
+
+			FinishBatch(C);
+
+			// Let writer threads close the client sockets. Closing may
+			// release entries, so walk a copy of the active connections.
+			vector<int> active=active_clients;
+			for(size_t k=0; k<active.size(); k++)
+			{
+				int i=active[k];
+				SDL_LockMutex(people[i].lock);
+				if(people[i].sock != NULL && people[i].context==context && !people[i].writer_eof)
+				{
+					people[i].closed=true;
+					FinishClient(i);
+					metrics.AddGauge("net.connections",-1);
+				}
+				SDL_UnlockMutex(people[i].lock);
+			}
+
+			Unwatch(C.servsock);
+			SDLNet_TCP_Close(C.servsock);
+			C.servsock=NULL;
+			C.events.clear();
+			C.last_event="";
+			C.created=false;
+		}
+
+		void SetServerPolling(bool polling)
+		{
+			server_polling=polling;
+		}
+
+		bool WaitServerEvents(int ms)
+		{
+			for(int i=0; i<server_contexts; i++)
+				if(contexts[i].events.size())
+					return true;
+
+			if(Evaluator::quitsignal)
+				return true;
+
+			if(!ServerInitialized())
+			{
+				SDL_Delay(ms);
+				return false;
+			}
+
+			PollSockets(ms);
+
+			for(int i=0; i<server_contexts; i++)
+				if(contexts[i].events.size())
+					return true;
+
+			return Evaluator::quitsignal;
+		}
+
 // Cleanup code
 		void cleanup()
 		{
+#ifdef USE_EPOLL
+			// Send remaining data with blocking writes before closing.
+			vector<int> active=active_clients;
+			for(size_t k=0; k<active.size(); k++)
+			{
+				int i=active[k];
+				if(people[i].sock!=NULL)
+				{
+					int fd=SocketFD(people[i].sock);
+					fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) & ~O_NONBLOCK);
+					people[i].writer_eof=true;
+					Flush(i);
+				}
+			}
+#else
 			TCPsocket socket;
 			int status;
 			
-			for(size_t i=0; i<MAX_CONNECTIONS; i++)
+			for(size_t k=0; k<active_clients.size(); k++)
 			{
+				int i=active_clients[k];
 				SDL_LockMutex(people[i].lock);
 				socket=people[i].sock;
 				SDL_UnlockMutex(people[i].lock);
@@ -735,18 +2332,20 @@ namespace Evaluator
 					SDL_WaitThread(people[i].writer_thread,&status);
 				}
 			}
+#endif
 					
 			for(size_t i=0; i<connections.size(); i++)
 			{
 				SDLNet_TCP_Close(connections[i]);
 //				cout << "SDLNet_TCP_Close(connections[" << i << "])" << endl;
 			}
-			if ( servsock != NULL )
-			{
-				SDLNet_TCP_Close(servsock);
-//				cout << "SDLNet_TCP_Close(servsock)" << endl;
-				servsock = NULL;
-			}
+			for(int i=0; i<server_contexts; i++)
+				if ( contexts[i].servsock != NULL )
+				{
+					SDLNet_TCP_Close(contexts[i].servsock);
+//					cout << "SDLNet_TCP_Close(servsock)" << endl;
+					contexts[i].servsock = NULL;
+				}
 			if ( client_socketset != NULL )
 			{
 				SDLNet_FreeSocketSet(client_socketset);
@@ -757,6 +2356,15 @@ namespace Evaluator
 				SDLNet_FreeSocketSet(socketset);
 				socketset = NULL;
 			}
+#ifdef USE_EPOLL
+			if ( epoll_fd >= 0 )
+			{
+				close(epoll_fd);
+				close(wake_fd);
+				epoll_fd = -1;
+				wake_fd = -1;
+			}
+#endif
 
 			SDLNet_Quit();
 			SDL_Quit();
@@ -767,6 +2375,8 @@ namespace Evaluator
 
 	void InitializeLibnet()
 	{
+		external_function["metrics_dump"]=&metrics_dump;
+		external_function["metrics_values"]=&metrics_values;
 		external_function["net_client_ip"]=&Libnet::net_client_ip;
 		external_function["net_client_name"]=&Libnet::net_client_name;
 		external_function["net_close"]=&Libnet::net_close;
@@ -774,22 +2384,26 @@ namespace Evaluator
 		external_function["net_create_server"]=&Libnet::net_create_server;
 		external_function["net_get"]=&Libnet::net_get;
 		external_function["net_isopen"]=&Libnet::net_isopen;
+		external_function["net_protocol"]=&Libnet::net_protocol;
 		external_function["net_send"]=&Libnet::net_send;
 		external_function["net_server_close"]=&Libnet::net_server_close;
 		external_function["net_server_get"]=&Libnet::net_server_get;
+		external_function["net_server_get_all"]=&Libnet::net_server_get_all;
+		external_function["net_server_high_water"]=&Libnet::net_server_high_water;
 		external_function["net_server_isopen"]=&Libnet::net_server_isopen;
+		external_function["net_server_max_connections"]=&Libnet::net_server_max_connections;
+		external_function["net_server_multicast"]=&Libnet::net_server_multicast;
+		external_function["net_server_queued"]=&Libnet::net_server_queued;
 		external_function["net_server_send"]=&Libnet::net_server_send;
 		external_function["net_server_send_all"]=&Libnet::net_server_send_all;
+		external_function["net_server_send_many"]=&Libnet::net_server_send_many;
+		external_function["net_server_update"]=&Libnet::net_server_update;
 
 		if (SDL_Init(SDL_INIT_TIMER|SDL_INIT_NOPARACHUTE|SDL_INIT_EVENTTHREAD) < 0)
 			throw Error::IO("LibraryInitializer::LibraryInitializer()","Couldn't initialize SDL");
 		if (SDLNet_Init() < 0)
 			throw Error::IO("LibraryInitializer::LibraryInitializer()","Couldn't initialize SDL_net");
 				
-		for(int i=0; i<MAX_CONNECTIONS; i++ )
-		{
-			Libnet::people[i].sock = NULL;
-		}
 		Libnet::client_socketset = SDLNet_AllocSocketSet(MAX_CONNECTIONS+1);
 
 #ifndef WIN32
@@ -35,6 +35,8 @@
 
 #include <signal.h>
 #include <map>
+#include <set>
+#include <algorithm>
 
 #include "game.h"
 
@@ -45,17 +47,247 @@
 #define MAPTO(ptr,key,ptr2) ptr2=ptr->FindKey(key);ptr2=&(*ptr2)[1]
 #define VECTO(ptr,index,ptr2) ptr2=&(*ptr)[index]
 
+// Seconds before cached trade matches are recomputed.
+#define TRADE_MATCH_INTERVAL 300
+// Number of best trade matches kept for each user.
+#define TRADE_MATCH_KEEP 50
+
 using namespace std;
 using namespace Evaluator;
 
+//
+// CardBitmap
+// ==========
+
+/// Set of card numbers stored as a sorted list of non-zero 32 bit words.
+class CardBitmap
+{
+	/// Word numbers in increasing order.
+	vector<unsigned int> word;
+	/// Bits of each word.
+	vector<unsigned int> bits;
+
+	/// Return the number of bits set in a word.
+	static int Bits(unsigned int w)
+	{
+#ifdef __GNUC__
+		return __builtin_popcount(w);
+#else
+		int n=0;
+		for(; w; w&=w-1)
+			n++;
+		return n;
+#endif
+	}
+
+  public:
+
+	/// Add a card to the set.
+	void Set(int card)
+	{
+		if(card < 0)
+			return;
+
+		unsigned int w=card >> 5;
+		vector<unsigned int>::iterator i=lower_bound(word.begin(),word.end(),w);
+		size_t n=i-word.begin();
+		if(i==word.end() || *i!=w)
+		{
+			word.insert(i,w);
+			bits.insert(bits.begin()+n,0);
+		}
+		bits[n]|=1U << (card & 31);
+	}
+	/// Return true if the card is in the set.
+	bool Has(int card) const
+	{
+		if(card < 0)
+			return false;
+
+		unsigned int w=card >> 5;
+		vector<unsigned int>::const_iterator i=lower_bound(word.begin(),word.end(),w);
+
+		return i!=word.end() && *i==w && (bits[i-word.begin()] & (1U << (card & 31)));
+	}
+	/// Return the number of cards in the set.
+	int Count() const
+	{
+		int n=0;
+		for(size_t i=0; i<bits.size(); i++)
+			n+=Bits(bits[i]);
+		return n;
+	}
+	/// Return the cards belonging to both sets.
+	CardBitmap operator&(const CardBitmap& b) const
+	{
+		CardBitmap ret;
+		size_t i=0,j=0;
+
+		while(i < word.size() && j < b.word.size())
+		{
+			if(word[i] < b.word[j])
+				i++;
+			else if(word[i] > b.word[j])
+				j++;
+			else
+			{
+				if(bits[i] & b.bits[j])
+				{
+					ret.word.push_back(word[i]);
+					ret.bits.push_back(bits[i] & b.bits[j]);
+				}
+				i++;
+				j++;
+			}
+		}
+
+		return ret;
+	}
+	/// Return true if all cards of the set 'b' are in this set.
+	bool Contains(const CardBitmap& b) const
+	{
+		size_t i=0;
+
+		for(size_t j=0; j<b.word.size(); j++)
+		{
+			while(i < word.size() && word[i] < b.word[j])
+				i++;
+			if(i==word.size() || word[i]!=b.word[j] || (b.bits[j] & ~bits[i]))
+				return false;
+		}
+
+		return true;
+	}
+	/// Remove a card from the set.
+	void Clear(int card)
+	{
+		if(card < 0)
+			return;
+
+		unsigned int w=card >> 5;
+		vector<unsigned int>::iterator i=lower_bound(word.begin(),word.end(),w);
+		if(i==word.end() || *i!=w)
+			return;
+
+		size_t n=i-word.begin();
+		bits[n]&=~(1U << (card & 31));
+		if(bits[n]==0)
+		{
+			word.erase(i);
+			bits.erase(bits.begin()+n);
+		}
+	}
+	/// Return the cards as a sorted list.
+	Data Cards() const
+	{
+		Data ret;
+		ret.MakeList(Count());
+
+		size_t n=0;
+		for(size_t i=0; i<word.size(); i++)
+			for(int b=0; b<32; b++)
+				if(bits[i] & (1U << b))
+					ret[n++]=int((word[i] << 5) | b);
+
+		return ret;
+	}
+};
+
 //
 // Server
 // ======
 
 class Server
 {
+	/// Offers of a single card ordered by price.
+	struct OfferBook
+	{
+		/// Sellers at each price level.
+		map<double,set<string> > levels;
+		/// Price asked by each seller.
+		map<string,double> seller;
+		/// Copy of 'prices' entry of the card the book was made from.
+		/// Any change to the entry makes a private copy of it, so the
+		/// book is up to date as long as the entry shares it's members.
+		Data source;
+	};
+
 	string error_trigger1,error_trigger2;
 	Evaluator::Triggers event_triggers;
+	/// Card sets collected from the collection of a user.
+	struct CollectionCache
+	{
+		/// True if the sets have been collected.
+		bool valid;
+		/// Entry revision of 'users' database the sets were collected at.
+		unsigned int revision;
+		/// Copy of the entry of the user in 'users' the sets were collected
+		/// from, if 'users' is not a database. Any change to the entry makes
+		/// a private copy of it, so the sets are up to date as long as the
+		/// entry shares it's members.
+		Data source;
+		/// Cards owned by the user.
+		CardBitmap owned;
+		/// Cards wanted by the user.
+		CardBitmap wanted;
+		/// Cards for sale or owned more than the trade limit as in have_list().
+		CardBitmap tradeable;
+
+		CollectionCache()
+			{valid=false; revision=0;}
+	};
+	/// Cached card sets by user name.
+	map<string,CollectionCache> collections;
+	/// Offer books mirroring 'prices' by card number. Built when first needed.
+	map<int,OfferBook> offers;
+	/// Number identifying this run of the market. Versions are valid only with the same epoch.
+	int market_epoch;
+	/// Version of the market increased whenever the best offer of a card changes.
+	int market_version;
+	/// Card number changed at each version. Only the latest change of a card is kept.
+	map<int,int> market_changes;
+	/// The latest version of each changed card.
+	map<int,int> card_version;
+	/// Cached full price list and the market version it was made for.
+	Data market_snapshot;
+	int market_snapshot_version;
+	/// Copy of 'prices' when the offer books were last known to be up
+	/// to date. A direct change to 'prices' gives it private members.
+	Data market_prices;
+
+	/// Mutual trade opportunity with another user.
+	struct TradeMatch
+	{
+		/// Name of the other user.
+		string other;
+		/// Number of cards wanted by the user and available from the other.
+		int gets;
+		/// Number of cards wanted by the other and available from the user.
+		int gives;
+	};
+
+	/// Trade matches of a user.
+	struct TradeState
+	{
+		/// Card sets of the user the matches were computed from.
+		CollectionCache cards;
+		/// The best matches, best first.
+		vector<TradeMatch> best;
+		/// Number of all matches of the user, including those not kept.
+		int matches;
+
+		TradeState()
+			{matches=0;}
+	};
+
+	/// Trade matches by user name.
+	map<string,TradeState> trades;
+	/// Users having each card available as in have_list(), by card number.
+	map<int,set<string> > trade_available;
+	/// Users wanting each card, by card number.
+	map<int,set<string> > trade_wanted;
+	/// Time when the trade matches were updated.
+	time_t trade_matches_time;
 
 	/// Check if user exist.
 	bool IsUser(const Data& username)
@@ -65,23 +297,87 @@ class Server
 		{return Data(0,0,0.0);}
 	/// Return address of the card structure in variable 'users'. Initialize if not exist.
 	Data* Card(const Data& user,const Data& number);
+	/// Return the collection of a user without modifying 'users'.
+	const Data& Collection(const Data& user);
+	/// Return the collection from an entry of 'users'.
+	static const Data& EntryCollection(const Data& entry);
+	/// Return the trade limit of a user.
+	int TradeLimit(const Data& user);
+	/// Return the trade limit from an entry of 'users'.
+	static int EntryTradeLimit(const Data& entry);
+	/// Return the cards owned by a user.
+	const CardBitmap& Owned(const Data& user);
+	/// Return the card sets of a user. Collect them again if the entry
+	/// of the user has been changed after they were collected.
+	const CollectionCache& UserCards(const Data& user);
+	/// Return true if the card sets have been collected from the current entry of the user.
+	bool UserCardsValid(const Data& user,const CollectionCache& cache);
+	/// Drop the cached card sets of a user before changing the entry.
+	void UserCardsChanging(const Data& user);
+	/// Mark the card sets of a user up to date with the entry after changing both.
+	void UserCardsUpdated(const Data& user);
+	/// Return a set of card numbers from a list of card numbers or (count,card number) pairs.
+	static CardBitmap CardSet(const Data& L);
 	/// Remove obsolete 'prices' entries.
 	int RemoveObsoletePrices(const Data& card_number);
+	/// Return the offer book of a card. Rebuild it from 'prices' if
+	/// it does not exist or the entry of the card has been changed
+	/// after the book was updated.
+	const OfferBook& Offers(int card);
+	/// Mark the offer book of a card up to date with 'prices' after changing both.
+	void OffersUpdated(int card);
+	/// Set the price of a seller in the offer book if the book exists.
+	void AddOffer(int card,const string& seller,double price);
+	/// Remove a seller from the offer book if the book exists.
+	void DelOffer(int card,const string& seller);
+	/// Return the best offer entry (card,(seller,price)) of the offer book or NULL if no offers.
+	static Data BestOffer(int card,const OfferBook& book);
+	/// Return the best offer entry of a card or NULL if no offers.
+	Data BestOffer(int card)
+		{return BestOffer(card,Offers(card));}
+	/// Assign a new market version to the card if it's best offer differs from 'before'.
+	void MarketChanged(int card,const Data& before);
+	/// Update all offer books and market versions if scripts have changed 'prices' directly.
+	void CheckMarket();
+	/// Release the copy of 'prices' before changing it. Return true if it was up to date.
+	bool PricesChanging();
+	/// Take a new copy of 'prices' after changing it, if the copy was up to date before.
+	void PricesChanged(bool synced);
+	/// Return true if the match 'a' is better than 'b'.
+	static bool BetterMatch(const TradeMatch& a,const TradeMatch& b);
+	/// Return the match between the users having the card sets 'cards' and 'other_cards'.
+	static TradeMatch Match(const string& other,const CollectionCache& cards,const CollectionCache& other_cards);
+	/// Add or remove the card sets of a user in the trade postings.
+	void TradePostings(const string& user,const CollectionCache& cards,bool add);
+	/// Compute all matches of a user from the trade postings.
+	void MatchUser(const string& user,TradeState& state);
+	/// Replace the match with a user whose card sets have changed from
+	/// 'before' to 'after'. Return false if the kept matches may now
+	/// miss a better one, so that MatchUser() is needed.
+	bool UpdateMatch(TradeState& state,const string& other,const CollectionCache& before,const CollectionCache& after);
+	/// Update trade matches of the users whose card sets have changed
+	/// and of their partners. Return the number of matching pairs.
+	int ComputeTradeMatches();
 	
 	Data add_to_collection(const Data&args);
 	Data check_card(const Data&args);
+	Data collection_progress(const Data&args);
+	Data common_cards(const Data&args);
 	Data count_cards(const Data&args);
 	Data del_prices(const Data&args);
 	Data have_list(const Data&args);
 	Data want_list(const Data&args);
 	Data is_user(const Data&args);
 	Data min_price(const Data&args);
+	Data price_changes(const Data&args);
 	Data price_list(const Data&args);
 	Data remove_obsolete_prices(const Data& args);
 	Data set_error_trigger(const Data&);
 	Data set_forsale(const Data&args);
 	Data set_price(const Data&args);
+	Data trade_matches(const Data&args);
 	Data user_has_cards(const Data&args);
+	Data user_owns_all(const Data&args);
 	Data get_card_data(const Data&args);
 #ifdef USE_SQUIRREL
     
@@ -109,8 +405,10 @@ class Server
 
 	Evaluator::Parser<Server> parser;
 	
-	Server(const list<string>& triggers,double bet,map<string,string> options);
+	Server(const list<string>& triggers,double bet,map<string,string> options,const string& savedir);
 	void TryTrigger(const string& str1,const string& str2);
+	/// Do periodic work before each call of "main" trigger.
+	void Tick();
 #ifdef USE_SQUIRREL
 
     // Squirrel proxy helper
@@ -127,14 +425,23 @@ class Server
 // Globals
 // =======
 
-/// Server itself.
-static Server* server=0;
+/// Servers hosted by the process, one for each table. Tables which have quit are NULL.
+static vector<Server*> tables;
 
 // Server member functions
 // =======================
 
-Server::Server(const list<string>& triggers,double bet,map<string,string> options) : parser(this)
+Server::Server(const list<string>& triggers,double bet,map<string,string> options,const string& savedir) : parser(this)
 {
+	// Tables started in the same second get different epochs.
+	static int last_epoch=0;
+	market_epoch=max(int(time(0)),last_epoch+1);
+	last_epoch=market_epoch;
+	market_version=0;
+	market_snapshot_version=-1;
+	trade_matches_time=0;
+	parser.SetSaveDir(savedir);
+
 	parser.SetVariable("database.cards",Database::cards.Cards());
 	parser.SetVariable("bet",bet);
 	
@@ -144,18 +451,23 @@ Server::Server(const list<string>& triggers,double bet,map<string,string> option
 	
 	parser.SetFunction("add_to_collection",&Server::add_to_collection);
 	parser.SetFunction("check_card",&Server::check_card);
+	parser.SetFunction("collection_progress",&Server::collection_progress);
+	parser.SetFunction("common_cards",&Server::common_cards);
 	parser.SetFunction("count_cards",&Server::count_cards);
 	parser.SetFunction("del_prices",&Server::del_prices);
 	parser.SetFunction("is_user",&Server::is_user);
 	parser.SetFunction("have_list",&Server::have_list);
 	parser.SetFunction("want_list",&Server::want_list);
 	parser.SetFunction("min_price",&Server::min_price);
+	parser.SetFunction("price_changes",&Server::price_changes);
 	parser.SetFunction("price_list",&Server::price_list);
 	parser.SetFunction("remove_obsolete_prices",&Server::remove_obsolete_prices);
 	parser.SetFunction("set_error_trigger",&Server::set_error_trigger);
 	parser.SetFunction("set_forsale",&Server::set_forsale);
 	parser.SetFunction("set_price",&Server::set_price);
+	parser.SetFunction("trade_matches",&Server::trade_matches);
 	parser.SetFunction("user_has_cards",&Server::user_has_cards);
+	parser.SetFunction("user_owns_all",&Server::user_owns_all);
 	parser.SetFunction("get_card_data",&Server::get_card_data);
 
 	list<string>::const_iterator i;
@@ -219,6 +531,8 @@ Data Server::set_error_trigger(const Data& args)
 
 Data* Server::Card(const Data& user,const Data& number)
 {
+	UserCardsChanging(user);
+
 	VAR(col,"users");
 	MAP(col,user);
 	VEC(col,2);
@@ -230,20 +544,299 @@ Data* Server::Card(const Data& user,const Data& number)
 	return entry;
 }
 
+const Server::OfferBook& Server::Offers(int card)
+{
+	VAR(prices,"prices");
+	const Data& P=prices->IsList() ? ((const Data&)*prices)[Data(card)] : Null;
+	size_t sellers=P.IsList() ? P.Size() : 0;
+
+	map<int,OfferBook>::iterator i=offers.find(card);
+	if(i!=offers.end() && (P.IsList() ? i->second.source.Shares(P) : !i->second.source.IsList()))
+		return i->second;
+
+	// Scripts have changed 'prices' directly, if the book exists.
+	bool changed=(i!=offers.end());
+	Data before;
+	if(changed)
+		before=BestOffer(card,i->second);
+
+	OfferBook& book=offers[card];
+	book.levels.clear();
+	book.seller.clear();
+	for(size_t j=0; j<sellers; j++)
+	{
+		book.levels[P[j][1].Real()].insert(P[j][0].String());
+		book.seller[P[j][0].String()]=P[j][1].Real();
+	}
+	book.source=P;
+
+	if(changed)
+		MarketChanged(card,before);
+
+	return book;
+}
+
+Data Server::BestOffer(int card,const OfferBook& book)
+{
+	if(book.levels.empty())
+		return Null;
+
+	const set<string>& sellers=book.levels.begin()->second;
+	Data ret(card,Data(string(""),book.levels.begin()->first));
+
+	if(sellers.size()==1)
+		ret[1][0]=*sellers.begin();
+	else
+		ret[1][0]=string(ToString(sellers.size())+" sellers");
+
+	return ret;
+}
+
+void Server::MarketChanged(int card,const Data& before)
+{
+	if(BestOffer(card)==before)
+		return;
+
+	map<int,int>::iterator i=card_version.find(card);
+	if(i!=card_version.end())
+		market_changes.erase(i->second);
+
+	card_version[card]=++market_version;
+	market_changes[market_version]=card;
+}
+
+bool Server::PricesChanging()
+{
+	VAR(prices,"prices");
+	bool synced=prices->IsList() ? market_prices.Shares(*prices) : !market_prices.IsList();
+
+	// Holding the copy would make the change copy all of 'prices'.
+	market_prices=Null;
+
+	return synced;
+}
+
+void Server::PricesChanged(bool synced)
+{
+	if(!synced)
+		return;
+
+	VAR(prices,"prices");
+	market_prices=Data(*prices);
+}
+
+void Server::CheckMarket()
+{
+	VAR(prices,"prices");
+	const Data& P=*prices;
+
+	if(P.IsList() ? market_prices.Shares(P) : !market_prices.IsList())
+		return;
+
+	// Check every card having offers now or before.
+	set<int> cards;
+	if(P.IsList())
+		for(size_t i=0; i<P.Size(); i++)
+			if(P[i].IsList(2) && P[i][0].IsInteger())
+				cards.insert(P[i][0].Integer());
+
+	map<int,OfferBook>::const_iterator i;
+	for(i=offers.begin(); i!=offers.end(); i++)
+		cards.insert(i->first);
+
+	for(set<int>::const_iterator j=cards.begin(); j!=cards.end(); j++)
+	{
+		bool known=(offers.find(*j)!=offers.end());
+		Data offer=BestOffer(*j);
+		if(!known && !offer.IsNull())
+			MarketChanged(*j,Null);
+	}
+
+	market_prices=Data(P);
+}
+
+void Server::OffersUpdated(int card)
+{
+	map<int,OfferBook>::iterator i=offers.find(card);
+	if(i==offers.end())
+		return;
+
+	VAR(prices,"prices");
+	i->second.source=prices->IsList() ? ((const Data&)*prices)[Data(card)] : Null;
+}
+
+void Server::AddOffer(int card,const string& seller,double price)
+{
+	map<int,OfferBook>::iterator i=offers.find(card);
+	if(i==offers.end())
+		return;
+
+	DelOffer(card,seller);
+	i->second.levels[price].insert(seller);
+	i->second.seller[seller]=price;
+}
+
+void Server::DelOffer(int card,const string& seller)
+{
+	map<int,OfferBook>::iterator i=offers.find(card);
+	if(i==offers.end())
+		return;
+
+	OfferBook& book=i->second;
+	map<string,double>::iterator j=book.seller.find(seller);
+	if(j==book.seller.end())
+		return;
+
+	map<double,set<string> >::iterator level=book.levels.find(j->second);
+	level->second.erase(seller);
+	if(level->second.empty())
+		book.levels.erase(level);
+	book.seller.erase(j);
+}
+
+const Data& Server::Collection(const Data& user)
+{
+	return EntryCollection(parser.Variable("users")[user]);
+}
+
+const Data& Server::EntryCollection(const Data& entry)
+{
+	static Data empty;
+	if(!empty.IsList())
+		empty.MakeList();
+
+	if(!entry.IsList() || entry.Size() < 3 || !entry[2].IsList())
+		return empty;
+
+	return entry[2];
+}
+
+int Server::TradeLimit(const Data& user)
+{
+	return EntryTradeLimit(parser.Variable("users")[user]);
+}
+
+int Server::EntryTradeLimit(const Data& entry)
+{
+	// Limit is users{user}[3][0]{"trade_limit"}.
+	if(entry.IsList() && entry.Size() > 3 && entry[3].IsList() && entry[3].Size() > 0 && entry[3][0].IsList())
+	{
+		const Data& limit=entry[3][0][Data("trade_limit")];
+		if(!limit.IsNull())
+			return limit.Integer();
+	}
+
+	return 4;
+}
+
+const CardBitmap& Server::Owned(const Data& user)
+{
+	return UserCards(user).owned;
+}
+
+bool Server::UserCardsValid(const Data& user,const CollectionCache& cache)
+{
+	if(!cache.valid)
+		return false;
+
+	DataFileDB* db=parser.Database("users");
+	if(db)
+		return cache.revision==db->EntryRevision(user);
+
+	return cache.source.Shares(parser.Variable("users")[user]);
+}
+
+const Server::CollectionCache& Server::UserCards(const Data& user)
+{
+	CollectionCache& cache=collections[user.String()];
+	if(UserCardsValid(user,cache))
+		return cache;
+
+	cache.owned=CardBitmap();
+	cache.wanted=CardBitmap();
+	cache.tradeable=CardBitmap();
+
+	// Do not keep the entry in memory just for collecting the sets.
+	DataFileDB* db=parser.Database("users");
+	Data record=db ? db->Peek(user) : parser.Variable("users")[user];
+	const Data& cards=EntryCollection(record);
+	int trade_limit=EntryTradeLimit(record);
+
+	for(size_t i=0; i<cards.Size(); i++)
+	{
+		const Data& entry=cards[i][1];
+		if(!entry.IsList(3) || !cards[i][0].IsInteger())
+			continue;
+
+		int card=cards[i][0].Integer();
+		if(entry[0].Integer() > 0)
+			cache.owned.Set(card);
+		if(entry[1].Integer() < 0)
+			cache.wanted.Set(card);
+		if(entry[1].Integer() > 0 || entry[0].Integer() > trade_limit)
+			cache.tradeable.Set(card);
+	}
+
+	UserCardsUpdated(user);
+
+	return cache;
+}
+
+void Server::UserCardsChanging(const Data& user)
+{
+	map<string,CollectionCache>::iterator i=collections.find(user.String());
+	if(i==collections.end())
+		return;
+
+	i->second.valid=false;
+	i->second.source=Null;
+}
+
+void Server::UserCardsUpdated(const Data& user)
+{
+	CollectionCache& cache=collections[user.String()];
+	DataFileDB* db=parser.Database("users");
+
+	if(db)
+		cache.revision=db->EntryRevision(user);
+	else
+		cache.source=parser.Variable("users")[user];
+
+	cache.valid=true;
+}
+
+CardBitmap Server::CardSet(const Data& L)
+{
+	CardBitmap ret;
+
+	for(size_t i=0; i<L.Size(); i++)
+		if(L[i].IsInteger())
+			ret.Set(L[i].Integer());
+		else if(L[i].IsList(2) && L[i][1].IsInteger())
+			ret.Set(L[i][1].Integer());
+
+	return ret;
+}
+
 // Scan unused pricing information and remove them. Return number of
 // entries removed.
 int Server::RemoveObsoletePrices(const Data& card_number)
 {
+	Data before=BestOffer(card_number.Integer());
+	bool synced=PricesChanging();
+
 	VAR(prices,"prices");
 	MAP(prices,card_number);
 	if(prices->IsNull())
 	{
 		prices->MakeList();
+		PricesChanged(synced);
 		return false;
 	}
 
 	// Get list of obsolete sellers.
-	list<Data> obsolete;
+	Data obsolete;
+	obsolete.MakeList();
 	const Data& P=*prices;
 	Data *entry,*sell;
 	for(size_t i=0; i<P.Size(); i++)
@@ -251,14 +844,20 @@ int Server::RemoveObsoletePrices(const Data& card_number)
 	  entry=Card(P[i][0],card_number);
 		VECTO(entry,1,sell);
 		if(*sell < 1)
-			obsolete.push_back(P[i][0]);
+		{
+			obsolete.AddList(P[i][0]);
+			DelOffer(card_number.Integer(),P[i][0].String());
+		}
 	}
 
-	// Clean prices.
-	for(list<Data>::iterator i=obsolete.begin(); i!=obsolete.end(); i++)
-		*prices=parser.del_entry(Data(*i,*prices));
+	// Clean prices in one pass.
+	if(obsolete.Size())
+		prices->DelEntries(obsolete);
+	OffersUpdated(card_number.Integer());
+	MarketChanged(card_number.Integer(),before);
+	PricesChanged(synced);
 
-	return (int)obsolete.size();
+	return (int)obsolete.Size();
 }
 
 /// remove_obsolete_prices(card numbers) - Helper function to make
@@ -305,6 +904,13 @@ Data Server::add_to_collection(const Data& args)
 	if(!args.IsList(2) || !args[0].IsString() || !args[1].IsList())
 		ArgumentError("add_to_collection",args);
 
+	// Keep the cached card sets current if nothing else has changed them.
+	map<string,CollectionCache>::iterator cache=collections.find(args[0].String());
+	bool fresh=(cache!=collections.end() && UserCardsValid(args[0],cache->second));
+	int trade_limit=TradeLimit(args[0]);
+
+	UserCardsChanging(args[0]);
+
 	VAR(col,"users");
 	MAP(col,args[0]);
 	VEC(col,2);
@@ -327,7 +933,20 @@ Data Server::add_to_collection(const Data& args)
 		*entry=*entry+1;
 		if(*want < Data(0))
 			*want=*want+1;
+
+		if(fresh)
+		{
+			int card=L[i].Integer();
+			cache->second.owned.Set(card);
+			if(want->Integer() >= 0)
+				cache->second.wanted.Clear(card);
+			if(want->Integer() > 0 || entry->Integer() > trade_limit)
+				cache->second.tradeable.Set(card);
+		}
 	}
+
+	if(fresh)
+		UserCardsUpdated(args[0]);
 	
 	return Null;
 }
@@ -352,12 +971,19 @@ Data Server::set_price(const Data& args)
 	VEC(entry,2);
 	*entry=price;
 
+	Data before=BestOffer(args[1].Integer());
+	bool synced=PricesChanging();
+
 	VAR(prices,"prices");
 	MAP(prices,args[1]);
 	if(prices->IsNull())
 		prices->MakeList();
 	MAP(prices,args[0]);
 	*prices=price;
+	AddOffer(args[1].Integer(),args[0].String(),price);
+	OffersUpdated(args[1].Integer());
+	MarketChanged(args[1].Integer(),before);
+	PricesChanged(synced);
 	
 	return 1;
 }
@@ -374,44 +1000,10 @@ Data Server::have_list(const Data& args)
 	if(!IsUser(args[1]))
 		throw LangErr("have_list","invalid user "+tostr(args[0]).String());
 
-	VAR(asker,"users"); // asker=users{args}
-	MAP(asker,args[0]); // asker=users{args[0]}
-	VEC(asker,2);       // asker=users{args[0]}[2]
-	VAR(user,"users");
-	MAP(user,args[1]); // users=users{args[1]}
-
-	// Find the limit
-	Data *limit;
-	VECTO(user,3,limit);          // limit=users{args[1]}[3]
-	VEC(limit,0);                 // limit=users{args[1]}[3][0]
-	MAP(limit,Data("trade_limit"));// limit=users{args[1]}[3][0]{"trade_limit"}
-
-	int trade_limit;
-	if(limit->IsNull())
-		trade_limit=4;
-	else
-		trade_limit=limit->Integer();
-
-	// Check all cards
-	Data ret;
-	Data *cards,*entry;
-	VECTO(user,2,cards); // cards=users{args}[2]
+	// Cards wanted by the asker and available from the target.
+	const CardBitmap& wanted=UserCards(args[0]).wanted;
 
-	ret.MakeList();
-	for(size_t i=0; i<cards->Size(); i++)
-	{
-		if((*cards)[i][1][1] > 0 || (*cards)[i][1][0].Integer() > trade_limit)
-		{
-			// Add only wanted cards
-			MAPTO(asker,(*cards)[i][0],entry);
-			if(entry->IsNull())
-				*entry=NewCard();
-			if((*entry)[1] < 0)
-				ret.AddList((*cards)[i][0]);
-		}
-	}
-	
-	return ret;
+	return (wanted & UserCards(args[1]).tradeable).Cards();
 }
 
 /// want_list(user asking, user target) - Return a list of cards which target wants.
@@ -425,29 +1017,305 @@ Data Server::want_list(const Data& args)
 	if(!IsUser(args[1]))
 		throw LangErr("want_list","invalid user "+tostr(args[0]).String());
 
-	VAR(asker,"users"); // asker=users{args}
-	MAP(asker,args[0]); // asker=users{args[0]}
-	VEC(asker,2);       // asker=users{args[0]}[2]
-	VAR(user,"users");
-	MAP(user,args[1]); // users=users{args[1]}
+	// Cards wanted by the target and owned by the asker.
+	const CardBitmap& wanted=UserCards(args[1]).wanted;
 
-	// Check all cards
-	Data ret;
-	Data *cards,*entry;
-	VECTO(user,2,cards); // cards=users{args}[2]
+	return (wanted & Owned(args[0])).Cards();
+}
 
-	ret.MakeList();
-	for(size_t i=0; i<cards->Size(); i++)
+bool Server::BetterMatch(const TradeMatch& a,const TradeMatch& b)
+{
+	int a_min=min(a.gets,a.gives),b_min=min(b.gets,b.gives);
+
+	if(a_min!=b_min)
+		return a_min > b_min;
+	if(a.gets+a.gives!=b.gets+b.gives)
+		return a.gets+a.gives > b.gets+b.gives;
+
+	return a.other < b.other;
+}
+
+Server::TradeMatch Server::Match(const string& other,const CollectionCache& cards,const CollectionCache& other_cards)
+{
+	TradeMatch match;
+	match.other=other;
+	match.gets=(cards.wanted & other_cards.tradeable).Count();
+	match.gives=(other_cards.wanted & cards.tradeable).Count();
+
+	return match;
+}
+
+void Server::TradePostings(const string& user,const CollectionCache& cards,bool add)
+{
+	for(int k=0; k<2; k++)
 	{
-		// Add only cards that asker have
-		MAPTO(asker,(*cards)[i][0],entry);
-		if(entry->IsNull())
-			*entry=NewCard();
+		map<int,set<string> >& postings=k ? trade_wanted : trade_available;
+		Data L=k ? cards.wanted.Cards() : cards.tradeable.Cards();
 
-		if((*cards)[i][1][1] < 0 && (*entry)[0] > 0)
-			ret.AddList((*cards)[i][0]);
+		for(size_t i=0; i<L.Size(); i++)
+		{
+			int card=L[i].Integer();
+			if(add)
+				postings[card].insert(user);
+			else
+			{
+				map<int,set<string> >::iterator p=postings.find(card);
+				if(p!=postings.end())
+				{
+					p->second.erase(user);
+					if(p->second.empty())
+						postings.erase(p);
+				}
+			}
+		}
 	}
-	
+}
+
+void Server::MatchUser(const string& user,TradeState& state)
+{
+	// Count the cards the user can get from and give to other users.
+	map<string,pair<int,int> > count;
+	map<string,pair<int,int> >::const_iterator c;
+	map<int,set<string> >::const_iterator p;
+	set<string>::const_iterator j;
+	Data L;
+
+	L=state.cards.wanted.Cards();
+	for(size_t i=0; i<L.Size(); i++)
+	{
+		p=trade_available.find(L[i].Integer());
+		if(p!=trade_available.end())
+			for(j=p->second.begin(); j!=p->second.end(); j++)
+				if(*j!=user)
+					count[*j].first++;
+	}
+
+	L=state.cards.tradeable.Cards();
+	for(size_t i=0; i<L.Size(); i++)
+	{
+		p=trade_wanted.find(L[i].Integer());
+		if(p!=trade_wanted.end())
+			for(j=p->second.begin(); j!=p->second.end(); j++)
+				if(*j!=user)
+					count[*j].second++;
+	}
+
+	// Keep only the best matches. The worst kept match is on the top
+	// of the heap.
+	vector<TradeMatch>& best=state.best;
+	best.clear();
+	state.matches=0;
+	for(c=count.begin(); c!=count.end(); c++)
+	{
+		if(c->second.first==0 || c->second.second==0)
+			continue;
+
+		TradeMatch match;
+		match.other=c->first;
+		match.gets=c->second.first;
+		match.gives=c->second.second;
+		state.matches++;
+
+		if(best.size() < TRADE_MATCH_KEEP)
+		{
+			best.push_back(match);
+			push_heap(best.begin(),best.end(),BetterMatch);
+		}
+		else if(BetterMatch(match,best.front()))
+		{
+			pop_heap(best.begin(),best.end(),BetterMatch);
+			best.back()=match;
+			push_heap(best.begin(),best.end(),BetterMatch);
+		}
+	}
+
+	sort_heap(best.begin(),best.end(),BetterMatch);
+}
+
+bool Server::UpdateMatch(TradeState& state,const string& other,const CollectionCache& before,const CollectionCache& after)
+{
+	vector<TradeMatch>& best=state.best;
+	TradeMatch old_match=Match(other,state.cards,before);
+	TradeMatch match=Match(other,state.cards,after);
+	bool was=(old_match.gets && old_match.gives);
+	bool is=(match.gets && match.gives);
+
+	// Matches not kept are all worse than the last one kept.
+	bool truncated=(state.matches > (int)best.size());
+	TradeMatch last;
+	if(best.size())
+		last=best.back();
+
+	bool dropped=false;
+	for(size_t i=0; i<best.size(); i++)
+		if(best[i].other==other)
+		{
+			best.erase(best.begin()+i);
+			dropped=true;
+			break;
+		}
+
+	state.matches+=int(is)-int(was);
+	if(is)
+	{
+		best.insert(lower_bound(best.begin(),best.end(),match,BetterMatch),match);
+		if(best.size() > TRADE_MATCH_KEEP)
+			best.pop_back();
+	}
+
+	// A kept match got worse than the last one kept, so some match not
+	// kept may be better than it.
+	return !(truncated && dropped && (!is || BetterMatch(last,match)));
+}
+
+int Server::ComputeTradeMatches()
+{
+	trade_matches_time=time(0);
+
+	Data names=parser.Variable("users").Keys();
+	if(!names.IsList())
+		names.MakeList();
+
+	// Find the users whose card sets have changed since the last update
+	// and users removed since then. The card sets of a user are
+	// collected again only if the entry of the user has changed.
+	map<string,CollectionCache> before;
+	map<string,CollectionCache>::const_iterator b;
+	map<string,TradeState>::iterator t;
+	set<string> current;
+
+	for(size_t u=0; u<names.Size(); u++)
+	{
+		string name=names[u].String();
+		current.insert(name);
+
+		t=trades.find(name);
+		if(t==trades.end())
+			before[name]=CollectionCache();
+		else if(!UserCardsValid(names[u],t->second.cards))
+			before[name]=t->second.cards;
+	}
+	for(t=trades.begin(); t!=trades.end(); t++)
+		if(current.find(t->first)==current.end())
+			before[t->first]=t->second.cards;
+
+	// Move the changed users in the postings.
+	for(b=before.begin(); b!=before.end(); b++)
+	{
+		TradePostings(b->first,b->second,false);
+		if(current.find(b->first)!=current.end())
+		{
+			TradeState& state=trades[b->first];
+			state.cards=UserCards(b->first);
+			TradePostings(b->first,state.cards,true);
+		}
+		else
+			trades.erase(b->first);
+	}
+
+	// Find unchanged users who may match with the changed users before
+	// or after the change.
+	static const CollectionCache removed;
+	map<string,set<string> > partners;
+	map<int,set<string> >::const_iterator p;
+	set<string>::const_iterator j;
+	Data L;
+
+	for(b=before.begin(); b!=before.end(); b++)
+	{
+		t=trades.find(b->first);
+		const CollectionCache& after=(t==trades.end() ? removed : t->second.cards);
+
+		for(int k=0; k<4; k++)
+		{
+			const CollectionCache& cards=(k & 1) ? after : b->second;
+			const map<int,set<string> >& postings=(k & 2) ? trade_available : trade_wanted;
+
+			L=(k & 2) ? cards.wanted.Cards() : cards.tradeable.Cards();
+			for(size_t i=0; i<L.Size(); i++)
+			{
+				p=postings.find(L[i].Integer());
+				if(p!=postings.end())
+					for(j=p->second.begin(); j!=p->second.end(); j++)
+						if(before.find(*j)==before.end())
+							partners[*j].insert(b->first);
+			}
+		}
+	}
+
+	// Compute the matches of the changed users again and update the
+	// matches of their partners.
+	for(t=trades.begin(); t!=trades.end(); t++)
+		if(before.find(t->first)!=before.end())
+			MatchUser(t->first,t->second);
+
+	map<string,set<string> >::const_iterator q;
+	for(q=partners.begin(); q!=partners.end(); q++)
+	{
+		TradeState& state=trades[q->first];
+		for(j=q->second.begin(); j!=q->second.end(); j++)
+		{
+			t=trades.find(*j);
+			if(!UpdateMatch(state,*j,before[*j],t==trades.end() ? removed : t->second.cards))
+			{
+				MatchUser(q->first,state);
+				break;
+			}
+		}
+	}
+
+	// Each pair is counted from both sides.
+	int pairs=0;
+	for(t=trades.begin(); t!=trades.end(); t++)
+		pairs+=t->second.matches;
+
+	return pairs/2;
+}
+
+void Server::Tick()
+{
+	if(time(0) - trade_matches_time < TRADE_MATCH_INTERVAL)
+		return;
+
+	try
+	{
+		ComputeTradeMatches();
+	}
+	catch(Error::General e)
+	{
+		cerr << e.Message() << endl;
+	}
+}
+
+/// trade_matches(user,max) - Return at most 'max' best trading partners
+///   of the user as a list of triplets (other user,# cards user can get,#
+///   cards other can get). Only users able to trade in both directions
+///   are returned. Matches are updated every few minutes between the
+///   calls of "main" trigger for users whose collections have changed and
+///   their partners, and at most 50 best are kept for each user. If
+///   called with NULL argument, update matches now and return the number
+///   of matching pairs.
+Data Server::trade_matches(const Data& args)
+{
+	if(args.IsNull())
+		return ComputeTradeMatches();
+
+	if(!args.IsList(2) || !args[0].IsString() || !args[1].IsInteger())
+		ArgumentError("trade_matches",args);
+	if(!IsUser(args[0]))
+		throw LangErr("trade_matches","invalid user "+args[0].String());
+
+	Data ret;
+	ret.MakeList();
+
+	map<string,TradeState>::const_iterator i=trades.find(args[0].String());
+	if(i==trades.end())
+		return ret;
+
+	const vector<TradeMatch>& best=i->second.best;
+	for(size_t j=0; j<best.size() && (int)j<args[1].Integer(); j++)
+		ret.AddList(Data(best[j].other,best[j].gets,best[j].gives));
+
 	return ret;
 }
 
@@ -462,42 +1330,18 @@ Data Server::min_price(const Data& args)
 
 // 	RemoveObsoletePrices(args);
 	
-	// Search price entry for the card.
-	VAR(prices,"prices");
-	MAP(prices,args);
-	if(prices->IsNull())
-		prices->MakeList();
+	// Take the sellers of the best offer from the offer book.
+	const OfferBook& book=Offers(args.Integer());
+	if(book.levels.empty())
+		return Null;
 
-	// Search list of sellers with the best offer.
-	const Data& L=*prices;
+	const set<string>& sellers=book.levels.begin()->second;
 
 	Data ret;
 	ret.MakeList(2);
-
-	double price=0.0;
-	list<string> sellers;
-
-	for(size_t i=0; i<L.Size(); i++)
-	{
-		double pr=L[i][1].Real();
-		
-		if(sellers.size()==0 || pr < price)
-		{
-			sellers.clear();
-			sellers.push_back(L[i][0].String());
-			price=pr;
-		}
-		else if(pr==price)
-			sellers.push_back(L[i][0].String());
-	}
-
-	if(sellers.size()==0)
-		return Null;
-
-	// Fill the seller list for return value.
 	ret[0].MakeList(sellers.size());
-	ret[1]=price;
-	list<string>::iterator i;
+	ret[1]=book.levels.begin()->first;
+	set<string>::const_iterator i;
 	size_t j=0;
 	for(i=sellers.begin(); i!=sellers.end(); i++)
 		ret[0][j++]=*i;
@@ -511,64 +1355,17 @@ Data Server::min_price(const Data& args)
 ///   cards for sale, return NULL. If a list of card numbers
 ///   is given, return list of the prices for those cards. Without any
 ///   arguments, return the full list of all prices. NULLs are removed
-///   when returning a list.
+///   when returning a list. Changes made directly to the variable
+///   'prices' are noticed, but they cost a scan of all cards.
 Data Server::price_list(const Data& args)
 {
 	if(args.IsInteger())
 	{
-		int card_number=args.Integer();
-		
-		VAR(prices,"prices");
-	
-		// Create empty return value entry:
+		// Return value is
 		//
-		//    (card number,("",0.0))
+		//    (card number,(seller or "<n> sellers",best price))
 		//
-		Data ret(card_number,Data(string(""),0.0));
-
-		// Check if there are any prices.
-		if(!prices->HasKey(card_number))
-			return Null;
-
-		// Price list for the card
-		Data& P=(*prices->FindKey(args))[1];
-
-		double price,minprice=0.0;
-		bool first=true;
-		list<string> sellers;
-		list<int> seller_index;
-		
-		// Scan through pairs P[j]=(seller,price) and find the best offer
-		for(size_t j=0; j<P.Size(); j++)
-		{
-			price=P[j][1].Real();
-			if(first || price < minprice)
-			{
-				first=false;
-				minprice=price;
-				sellers.clear();
-				seller_index.clear();
-				sellers.push_back(P[j][0].String());
-				seller_index.push_back(j);
-			}
-			else if(price==minprice)
-			{
-				sellers.push_back(P[j][0].String());
-				seller_index.push_back(j);
-			}
-			
-		}
-
-		ret[1][1]=minprice;
-
-		if(sellers.size()==0)
-			return Null;
-		else if(sellers.size()==1)
-			ret[1][0]=sellers.front();
-		else
-			ret[1][0]=string(ToString(sellers.size())+" sellers");
-
-		return ret;
+		return BestOffer(args.Integer());
 	}
 	else if(args.IsList())
 	{
@@ -586,8 +1383,20 @@ Data Server::price_list(const Data& args)
 	}
 	else if(args.IsNull())
 	{
-		VAR(prices,"prices");
-		return price_list(prices->Keys());
+		// Full list is rebuilt only after the market has changed.
+		CheckMarket();
+		if(market_snapshot_version!=market_version)
+		{
+			VAR(prices,"prices");
+			Data keys=prices->Keys();
+			if(keys.IsList())
+				market_snapshot=price_list(keys);
+			else
+				market_snapshot.MakeList();
+			market_snapshot_version=market_version;
+		}
+
+		return market_snapshot;
 	}
 	else
 		ArgumentError("price_list",args);
@@ -595,6 +1404,52 @@ Data Server::price_list(const Data& args)
 	return Null;
 }
 
+/// price_changes(version) - Return pair (current market version,list
+///   of changes). A market version is a pair (epoch,number), where the
+///   epoch is different in each run of the server, and clients should
+///   pass it back unchanged. Changes are price_list() entries of the cards
+///   whose best offer has changed after the given market version, or
+///   (card number,NULL) if there are no offers left for the card. If the
+///   version is NULL or not from this run of the server, the full
+///   price_list() is returned instead. An up to date version gets an
+///   empty list.
+Data Server::price_changes(const Data& args)
+{
+	if(!args.IsNull() && !args.IsInteger() && !(args.IsList(2) && args[0].IsInteger() && args[1].IsInteger()))
+		ArgumentError("price_changes",args);
+
+	CheckMarket();
+
+	Data current(market_epoch,market_version);
+	int version=args.IsList() ? args[1].Integer() : 0;
+	if(!args.IsList() || args[0].Integer()!=market_epoch || version <= 0 || version > market_version)
+	{
+		Data snapshot=price_list(Null);
+		return Data(current,snapshot);
+	}
+
+	// Collect the cards first, since checking an offer book may
+	// register a new change.
+	vector<int> cards;
+	map<int,int>::const_iterator i;
+	for(i=market_changes.upper_bound(version); i!=market_changes.end(); i++)
+		cards.push_back(i->second);
+
+	Data ret;
+	ret.MakeList();
+
+	for(size_t j=0; j<cards.size(); j++)
+	{
+		Data e=BestOffer(cards[j]);
+		if(e.IsNull())
+			ret.AddList(Data(cards[j],Null));
+		else
+			ret.AddList(e);
+	}
+
+	return Data(current,ret);
+}
+
 /// set_forsale(user, card, how many) - Set the number of cards for sale (or wanted if < 0). Return NULL if fails, 1 if success and 2 if success and clients may need price refresh.
 Data Server::set_forsale(const Data& args)
 {
@@ -637,26 +1492,66 @@ Data Server::user_has_cards(const Data& args)
 		throw LangErr("user_has_cards","invalid user "+tostr(args[0]).String());
 
 	const Data& L=args[1];
-	Data* entry;
-	int proxies=0;
-	
-	VAR(col,"users");
-	MAP(col,args[0]);
-	VEC(col,2);
+	const CardBitmap& has=Owned(args[0]);
+	const Data& cards=Collection(args[0]);
+	int proxies=0,n;
 
 	for(size_t i=0; i<L.Size(); i++)
 	{
 		if(!L[i].IsList(2) || !L[i][0].IsInteger() || !L[i][1].IsInteger())
 			throw LangErr("user_has_cards","invalid entry "+tostr(L[i]).String());
 
-		entry=Card(args[0],L[i][1]);
-		if((*entry)[0].Integer() < L[i][0].Integer())
-			proxies+=L[i][0].Integer() - (*entry)[0].Integer();
+		// Look up the count only for cards the user owns at all.
+		n=has.Has(L[i][1].Integer()) ? cards[L[i][1]][0].Integer() : 0;
+		if(n < L[i][0].Integer())
+			proxies+=L[i][0].Integer() - n;
 	}
 	
 	return proxies;
 }
 
+/// user_owns_all(user,card list) - Return 1 if the user owns at least one copy of each card
+///   in the list, which may contain card numbers or (nmb. of cards,card number) pairs.
+Data Server::user_owns_all(const Data& args)
+{
+	if(!args.IsList(2) || !args[0].IsString() || !args[1].IsList())
+		ArgumentError("user_owns_all",args);
+	if(!IsUser(args[0]))
+		throw LangErr("user_owns_all","invalid user "+args[0].String());
+
+	return Owned(args[0]).Contains(CardSet(args[1])) ? 1 : 0;
+}
+
+/// collection_progress(user,card list) - Return pair (# distinct cards owned,# distinct cards)
+///   for a set of cards given as card numbers or (nmb. of cards,card number) pairs.
+Data Server::collection_progress(const Data& args)
+{
+	if(!args.IsList(2) || !args[0].IsString() || !args[1].IsList())
+		ArgumentError("collection_progress",args);
+	if(!IsUser(args[0]))
+		throw LangErr("collection_progress","invalid user "+args[0].String());
+
+	CardBitmap set=CardSet(args[1]);
+
+	return Data((Owned(args[0]) & set).Count(),set.Count());
+}
+
+/// common_cards(user1,user2) - Return a sorted list of card numbers owned by both users.
+Data Server::common_cards(const Data& args)
+{
+	if(!args.IsList(2) || !args[0].IsString() || !args[1].IsString())
+		ArgumentError("common_cards",args);
+	if(!IsUser(args[0]))
+		throw LangErr("common_cards","invalid user "+args[0].String());
+	if(!IsUser(args[1]))
+		throw LangErr("common_cards","invalid user "+args[1].String());
+
+	// Copy the first bitmap, since the second lookup may rebuild the cache.
+	CardBitmap first=Owned(args[0]);
+
+	return (first & Owned(args[1])).Cards();
+}
+
 /// count_cards(user) - Return triplet (# cards owned,# cards for sale,# cards wanted) for user.
 Data Server::count_cards(const Data& args)
 {
@@ -665,11 +1560,8 @@ Data Server::count_cards(const Data& args)
 	if(!IsUser(args))
 		throw LangErr("count_cards","invalid user "+args.String());
 
-	VAR(col,"users");
-	MAP(col,args);
-	VEC(col,2);
-
-	const Data& L=*col;
+	// Read without touching 'users' to keep the cached card sets valid.
+	const Data& L=Collection(args);
 	const Data* entry;
 	int n,sale=0,wanted=0,total=0;
 	
@@ -700,17 +1592,13 @@ Data Server::get_card_data(const Data& args)
 	if(!args[1].IsList())
 	    return Data();
 
-	VAR(collection,"users");
-	MAP(collection,args[0]);
-	VEC(collection,2);
-
+	const Data& collection=Collection(args[0]);
 	const Data& L=args[1];
 	Data ret;
 	ret.MakeList();
 	Data entry;
 	entry.MakeList(5);
 	Data price;
-	Data* card_data;
 
 	for(size_t i=0; i<L.Size(); i++)
 	{
@@ -734,12 +1622,12 @@ Data Server::get_card_data(const Data& args)
 		entry[2]=price[1][0];
 	    }
 	    // Get collection data
-	    if(collection->HasKey(L[i]))
+	    const Data& card_data=collection[L[i]];
+	    if(card_data.IsList(3))
 	    {
-		MAPTO(collection,L[i],card_data);
- 		entry[0]=(*card_data)[0];
- 		entry[3]=(*card_data)[2];
- 		entry[4]=(*card_data)[1];
+ 		entry[0]=card_data[0];
+ 		entry[3]=card_data[2];
+ 		entry[4]=card_data[1];
 	    }
 	    else
 	    {
@@ -776,28 +1664,39 @@ Data Server::del_prices(const Data& args)
 	if(!IsUser(args))
 		return Null;
 
+	bool synced=PricesChanging();
+
 	VAR(prices,"prices");
 	Data& P=*prices;
 
 	for(size_t i=0; i<P.Size();)
 	{
-		Data& Q=P[i][1]; // Q = user to price map for the card
+		// Q = user to price map for the card. Change it only if the
+		// user is found, so that other offer books stay up to date.
+		const Data& Q=((const Data&)P)[i][1];
 		for(size_t j=0; j<Q.Size(); j++)
 		{
 			if(Q[j][0]==args)
 			{
-				Q.DelList(j);
+				int card=P[i][0].Integer();
+				Data before=BestOffer(card);
+				DelOffer(card,args.String());
+				P[i][1].DelList(j);
+				OffersUpdated(card);
+				MarketChanged(card,before);
 				break;
 			}
 		}
 		
 		if(Q.Size()==0)
 		{
+			offers.erase(P[i][0].Integer());
 			P.DelList(i);
 		}
 		else
 			i++;
 	}
+	PricesChanged(synced);
 
 	return 1;
 }
@@ -816,6 +1715,14 @@ void usage()
 	cout << "           --server-ip <local server connecion ip>" << endl;
 	cout << "           --port <server port>" << endl;
 	cout << "           --load <trigger file>" << endl;
+	cout << "           --metrics <stats file written every minute>" << endl;
+	cout << "           --tables <number of tables hosted using consecutive ports>" << endl;
+	cout << "                    (tables after the first save to table<n> subdirectories" << endl;
+	cout << "                    and net_server_get() returns without waiting)" << endl;
+	cout << "           --max-connections <number of simultaneous client connections>" << endl;
+	cout << "           --high-water <bytes queued for a client before it is reported slow>" << endl;
+	cout << "           --max-input <bytes of an unfinished message before a client is dropped>" << endl;
+	cout << "           --max-frame <bytes of a binary frame payload before a client is dropped>" << endl;
 	cout << "  game server specific:" << endl;
 	cout << "           --server <meta server>" << endl;
 	cout << "           --rules <rules file>" << endl;
@@ -830,6 +1737,7 @@ int main(int argc,const char** argv)
 	{
 		Evaluator::InitializeLibnet();
 		Evaluator::InitializeLibcards();
+		Evaluator::metrics.Enable();
 
 		if(argc < 2)
 		{
@@ -843,7 +1751,7 @@ int main(int argc,const char** argv)
 		security.AllowReadFile(CCG_SAVEDIR"/*");
 		security.AllowWriteFile("./vardump");
 
-		int port=-1,players=0;
+		int port=-1,players=0,table_count=1;
 		Data ret;
 		int arg=1;
 		bool debug=false;
@@ -885,6 +1793,23 @@ int main(int argc,const char** argv)
 				options["server.ip"]=argv[++arg];
 			else if(opt=="--rules")
 				options["rules"]=argv[++arg];
+			else if(opt=="--tables")
+				table_count=atoi(argv[++arg]);
+			else if(opt=="--max-connections")
+				Evaluator::Libnet::SetMaxConnections(atoi(argv[++arg]));
+			else if(opt=="--high-water")
+				Evaluator::Libnet::SetDefaultHighWater(atoi(argv[++arg]));
+			else if(opt=="--max-input")
+				Evaluator::Libnet::SetMaxInput(atoi(argv[++arg]));
+			else if(opt=="--max-frame")
+				Evaluator::Libnet::SetFrameMax(atoi(argv[++arg]));
+			else if(opt=="--metrics")
+			{
+				string file=argv[++arg];
+				security.AllowWriteFile(file);
+				security.AllowWriteFile(file+".tmp");
+				Evaluator::metrics.SetDump(file,60);
+			}
 			else
 			{
 				cerr << "server: invalid option "+opt << endl;
@@ -899,7 +1824,7 @@ int main(int argc,const char** argv)
 		/* Load game description */
 			
 		Evaluator::savedir=CCG_SAVEDIR;
-		if(!opendir(Evaluator::savedir.c_str()))
+		if(!IsDirectory(Evaluator::savedir))
 #if defined(WIN32) || defined(__BCPLUSPLUS__)
 			_mkdir(Evaluator::savedir.c_str());
 #else
@@ -938,12 +1863,11 @@ int main(int argc,const char** argv)
 		security.AllowOpenDir(CCG_DATADIR"/scripts/global-server");
 		security.AllowOpenDir(CCG_DATADIR"/scripts/"+Database::game.Gamedir());	
 		security.AllowOpenDir(CCG_DATADIR"/scripts/"+Database::game.Gamedir()+"-server");
-		security.AllowOpenDir(CCG_SAVEDIR"/"+Database::game.Gamedir()+"/users-db");
 
 		if(options.find("rules")!=options.end())
 			security.AllowExecute(CCG_DATADIR"/scripts/"+options["rules"]);
 
-		if(!opendir(Evaluator::savedir.c_str()))
+		if(!IsDirectory(Evaluator::savedir))
 #if defined(WIN32) || defined(__BCPLUSPLUS__)
 			_mkdir(Evaluator::savedir.c_str());
 #else
@@ -956,7 +1880,8 @@ int main(int argc,const char** argv)
 			return 1;
 		}
 
-		/* Parse card descriptions */
+		/* Parse card descriptions or map them from the snapshot */
+		list<string> card_files;
 		if(!dont_load_card_data)
 			for(int i=0; i<Database::game.CardSets(); i++)
 			{
@@ -977,50 +1902,142 @@ int main(int argc,const char** argv)
                                     opt+=Database::game.CardSet(i);
                                 }
 
-				cout << "Loading " << opt << endl;
-				Database::cards.AddCards(opt);
+				card_files.push_back(opt);
+			}
+
+		string snapshot=Evaluator::savedir+"/cards.snapshot";
+		if(card_files.size() && Database::cards.LoadSnapshot(snapshot,card_files))
+			cout << "Mapped " << snapshot << endl;
+		else if(card_files.size())
+		{
+			for(list<string>::iterator i=card_files.begin(); i!=card_files.end(); i++)
+			{
+				cout << "Loading " << *i << endl;
+				Database::cards.AddCards(*i);
 				if(Evaluator::quitsignal)
 					throw Error::Quit(1);
 			}
 
+			try
+			{
+				Database::cards.SaveSnapshot(snapshot);
+			}
+			catch(Error::IO e)
+			{
+				cerr << e.Message() << endl;
+			}
+		}
+
 		cout << "Total of " << Database::cards.Cards() << " cards loaded." << endl;
-		server=new Server(triggers,bet,options);
 
-		if(debug)
-			server->parser.SetVariable("options.debug",1);
-		if(tournament)
-			server->parser.SetVariable("options.tournament",1);
-		if(fulldebug)
-			Evaluator::debug=true;
+		// Card and game data are shared by all tables. Each table has
+		// its own interpreter and server context in the net library
+		// and tables after the first save to their own subdirectory.
+		if(table_count < 1)
+			table_count=1;
+		for(int i=0; i<table_count; i++)
+		{
+			string savedir=Evaluator::savedir;
+			if(i)
+			{
+				Evaluator::Libnet::SelectServerContext(Evaluator::Libnet::CreateServerContext());
 
-		cout << "Calling \"init\" \"\"" << endl;
-		server->TryTrigger("init","");
-		
-		if(port > 0)
-			server->parser.SetVariable("port",port);
-		if(players > 0)
-			server->parser.SetVariable("players_wanted",players);
-
-		security.AllowCreateSocket(server->parser.Variable("port").Integer());
-		if(server->parser.Variable("meta.server").IsString())
-			security.AllowConnect(server->parser.Variable("meta.server").String(),server->parser.Variable("meta.port").Integer());
-		if(server->parser.Variable("factory.server_name").IsString())
-			security.AllowConnect(server->parser.Variable("factory.server_name").String(),server->parser.Variable("factory.port").Integer());
-	
-		cout << "Calling \"init\" \"server\"" << endl;
-		server->TryTrigger("init","server");
-		cout << "Calling \"init\" \"game\"" << endl;
-		server->TryTrigger("init","game");
+				savedir+="/table"+ToString(i);
+				if(!IsDirectory(savedir))
+#if defined(WIN32) || defined(__BCPLUSPLUS__)
+					_mkdir(savedir.c_str());
+#else
+					mkdir(savedir.c_str(),0700);
+#endif
+			}
+			security.AllowOpenDir(savedir+"/users-db");
+
+			Server* server=new Server(triggers,bet,options,savedir);
+			tables.push_back(server);
+
+			if(debug)
+				server->parser.SetVariable("options.debug",1);
+			if(tournament)
+				server->parser.SetVariable("options.tournament",1);
+			if(fulldebug)
+				Evaluator::debug=true;
+
+			cout << "Calling \"init\" \"\"" << endl;
+			server->TryTrigger("init","");
+
+			if(port > 0)
+				server->parser.SetVariable("port",port+i);
+			else if(i)
+				server->parser.SetVariable("port",server->parser.Variable("port").Integer()+i);
+			if(players > 0)
+				server->parser.SetVariable("players_wanted",players);
+
+			security.AllowCreateSocket(server->parser.Variable("port").Integer());
+			if(server->parser.Variable("meta.server").IsString())
+				security.AllowConnect(server->parser.Variable("meta.server").String(),server->parser.Variable("meta.port").Integer());
+			if(server->parser.Variable("factory.server_name").IsString())
+				security.AllowConnect(server->parser.Variable("factory.server_name").String(),server->parser.Variable("factory.port").Integer());
+
+			cout << "Calling \"init\" \"server\"" << endl;
+			server->TryTrigger("init","server");
+			cout << "Calling \"init\" \"game\"" << endl;
+			server->TryTrigger("init","game");
+		}
 
-		while(1)
+		if(tables.size()==1)
 		{
-			if(Evaluator::quitsignal)
+			while(1)
 			{
-				status=1;
-				break;
+				if(Evaluator::quitsignal)
+				{
+					status=1;
+					break;
+				}
+
+				tables[0]->Tick();
+				tables[0]->TryTrigger("main","");
 			}
+		}
+		else
+		{
+			// Run all tables in one event loop. A table quitting
+			// closes only its own connections.
+			Evaluator::Libnet::SetServerPolling(true);
 
-			server->TryTrigger("main","");
+			size_t running=tables.size();
+			while(running)
+			{
+				if(Evaluator::quitsignal)
+				{
+					status=1;
+					break;
+				}
+
+				Evaluator::Libnet::WaitServerEvents(100);
+
+				for(size_t i=0; i<tables.size(); i++)
+				{
+					if(!tables[i])
+						continue;
+
+					Evaluator::Libnet::SelectServerContext(i);
+					try
+					{
+						tables[i]->Tick();
+						tables[i]->TryTrigger("main","");
+					}
+					catch(Error::Quit q)
+					{
+						status=q.ExitCode();
+						cout << "Table " << i << ": calling \"exit\" \"\"" << endl;
+						tables[i]->TryTrigger("exit","");
+						Evaluator::Libnet::CloseServerContext(i);
+						delete tables[i];
+						tables[i]=0;
+						running--;
+					}
+				}
+			}
 		}
 	}
 	catch(Error::Quit q)
@@ -1039,24 +2056,28 @@ int main(int argc,const char** argv)
         }
 
 	// Finish.
-	try
+	for(size_t i=0; i<tables.size(); i++)
 	{
-		if(server)
+		if(!tables[i])
+			continue;
+
+		try
 		{
+			Evaluator::Libnet::SelectServerContext(i);
 			cout << "Calling \"exit\" \"\"" << endl;
-			server->TryTrigger("exit","");
+			tables[i]->TryTrigger("exit","");
+		}
+		catch(Error::General e)
+		{
+			cout << endl << flush;
+			cerr << e.Message() << endl;
 		}
-	}
-	catch(Error::General e)
-	{
-		cout << endl << flush;
-		cerr << e.Message() << endl;
 	}
 
 	cout << "Done." << endl;
 
-	if(server)
-		delete server;
+	for(size_t i=0; i<tables.size(); i++)
+		delete tables[i];
 	
 	return status;
 }